@@ -2,6 +2,7 @@
 // Alphanumeric rendering to 8 row by <n> column array
 //
 
+#include <Arduino.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -274,27 +275,33 @@ unsigned char font_data[] = {
 };
 
 
+//
+// The matrix is wired as a serpentine: even columns run from the bottom row
+// up, odd columns from the top row down. A font byte already has its bits
+// in pixel order for an even column, and bitrev holds every byte reversed
+// for an odd one, so a column is drawn as 8 pixels in a row with no
+// per-pixel mapping.
+//
+unsigned char bitrev[256];
+
+void glyphCol(int physcol, int bits, int fg, int bg)
+{
+	if (physcol < 0)
+		return;
+	int m = (physcol % 2) ? bitrev[bits & 0xFF] : bits & 0xFF;
+	int p = physcol * 8;
+	for (int k = 0; k < 8; k++, m >>= 1)
+		led_put(0, p + k, (m & 1) ? fg : bg);
+}
+
 void charColAt(int basecol, int col, int c, int fg, int bg)
 {
-	for (int row = 0; row < 8; row++) {
-		int p;
-		if ((basecol+col) % 2)
-			p = (basecol + col) * 8 + row;
-		else
-			p = (basecol + col) * 8 + 7 - row;
-		if (FONT_BIT(c, col, row))
-			led_put(0, p, fg);
-		else
-			led_put(0, p, bg);
-	}
+	glyphCol(basecol + col, font_data[(unsigned char)c * FONT_CHAR_WIDTH + col], fg, bg);
 }
 
 void clearCol(int basecol, int col, int bg)
 {
-	for (int row = 0; row < 8; row++) {
-		int p = (basecol + col) * 8 + row;
-		led_put(0, p, bg);
-	}
+	glyphCol(basecol + col, 0, bg, bg);
 }
 
 void charAt(char c, int basecol, int fg, int bg)
@@ -309,10 +316,11 @@ void op_alpha_at()
 	int bg = forth_stack()->popint();
 	int fg = forth_stack()->popint();
 	int basecol = forth_stack()->popint();
-	char *str = forth_stack()->popstring();
+	Value* sv = forth_stack()->popstr();
+	char *str = sv->str;
 	for (unsigned int i = 0; i < strlen(str); i++)
 		charAt(str[i], basecol + (i * 6), fg, bg);
-	strdelete(str);
+	vfree(sv);
 }
 
 void op_char_at()
@@ -320,9 +328,10 @@ void op_char_at()
 	int bg = forth_stack()->popint();
 	int fg = forth_stack()->popint();
 	int basecol = forth_stack()->popint();
-	char *str = forth_stack()->popstring();
+	Value* sv = forth_stack()->popstr();
+	char *str = sv->str;
 	charAt(str[0], basecol, fg, bg);
-	strdelete(str);
+	vfree(sv);
 }
 
 void op_char_col_at()
@@ -331,9 +340,47 @@ void op_char_col_at()
 	int fg = forth_stack()->popint();
 	int col = forth_stack()->popint();
 	int basecol = forth_stack()->popint();
-	char *str = forth_stack()->popstring();
+	Value* sv = forth_stack()->popstr();
+	char *str = sv->str;
 	charColAt(basecol, col, str[0], fg, bg);
-	strdelete(str);
+	vfree(sv);
+}
+
+// 'str -- array
+// render a string once into an array of column bits, 6 columns a character
+void op_alpha_text()
+{
+	Value* sv = forth_stack()->popstr();
+	char *str = sv->str;
+	int n = strlen(str);
+	int* ia = iaalloc(n * 6);
+	for (int i = 0; i < n; i++) {
+		unsigned char* glyph = &font_data[(unsigned char)str[i] * FONT_CHAR_WIDTH];
+		for (int col = 0; col < 5; col++)
+			ia[i * 6 + col] = glyph[col];
+		ia[i * 6 + 5] = 0;
+	}
+	forth_stack()->push(ia, n * 6);
+	vfree(sv);
+}
+
+// array offset basecol ncols fg bg --
+// draw ncols columns of a text array, starting at column offset of the
+// array, onto the matrix at basecol; columns outside the array are blank
+void op_alpha_scroll()
+{
+	int bg = forth_stack()->popint();
+	int fg = forth_stack()->popint();
+	int ncols = forth_stack()->popint();
+	int basecol = forth_stack()->popint();
+	int offset = forth_stack()->popint();
+	Value* a = forth_stack()->pop();
+	int len = a->vtype == ARRAY ? a->len : 0;
+	for (int i = 0; i < ncols; i++) {
+		int src = offset + i;
+		glyphCol(basecol + i, src >= 0 && src < len ? a->ia[src] : 0, fg, bg);
+	}
+	vfree(a);
 }
 
 void op_fontdata()
@@ -343,10 +390,25 @@ void op_fontdata()
 	forth_stack()->push(font_data[(c*5)+col]);
 }
 
+const FBuiltin alpha_words[] PROGMEM = {
+  { "alpha:at", &op_alpha_at },
+  { "alpha:charat", &op_char_at },
+  { "alpha:charcolat", &op_char_col_at },
+  { "alpha:fontdata", &op_fontdata },
+  { "alpha:text", &op_alpha_text },
+  { "alpha:scroll", &op_alpha_scroll },
+};
+
+
 void alpha_init()
 {
-  forth_dict()->def("alpha:at", &op_alpha_at);
-  forth_dict()->def("alpha:charat", &op_char_at);
-  forth_dict()->def("alpha:charcolat", &op_char_col_at);
-  forth_dict()->def("alpha:fontdata", &op_fontdata);
+  for (int b = 0; b < 256; b++) {
+    int r = 0;
+    for (int k = 0; k < 8; k++)
+      if (b & (1 << k))
+        r |= 0x80 >> k;
+    bitrev[b] = r;
+  }
+
+  forth_dict()->builtins(alpha_words, sizeof(alpha_words) / sizeof(alpha_words[0]));
 }
@@ -0,0 +1,281 @@
+//
+// Dual core execution: the interpreter, its dictionary, stacks and free
+// lists, stay on the core running the Arduino loop, along with loop tasks,
+// the scheduler and coroutines. A task pinned to the other core reads
+// serial input, takes in packets and, once a native show function is
+// installed, shows the frames the frame pipeline hands over. The two cores
+// only share the queues below. Everything else belongs to one core:
+// packets are decoded on the interpreter core, which owns the ingest
+// counters and the LED slots, except for the pixels of a handed over
+// frame while the io core puts them.
+//
+//   dualframes  interpreter -> io     frames to show
+//   dualshown   io -> interpreter     their buffers, once shown
+//   dualinput   io -> interpreter     serial input, and packets to run
+//
+// Without a second core, the same calls do the work on the spot.
+//
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "forth.h"
+#include "led.h"
+#include "frame.h"
+#include "ingest.h"
+#include "dual.h"
+
+
+bool dual_full(DUALQUEUE* q)
+{
+  unsigned int tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+  return q->head - tail == DUAL_QUEUESIZE;
+}
+
+
+bool dual_push(DUALQUEUE* q, DUALITEM item)
+{
+  if (dual_full(q))
+    return false;
+  q->items[q->head & (DUAL_QUEUESIZE - 1)] = item;
+  __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+DUALITEM* dual_front(DUALQUEUE* q)
+{
+  unsigned int head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+  if (head == q->tail)
+    return NULL;
+  return &q->items[q->tail & (DUAL_QUEUESIZE - 1)];
+}
+
+
+void dual_next(DUALQUEUE* q)
+{
+  __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+
+// kinds of dualinput items
+enum DUALINPUT { DUAL_SERIAL, DUAL_TEXT, DUAL_BINARY };
+
+void (*dual_show)(int slot) = NULL;
+void (*dual_poll)() = NULL;
+
+
+void dual_pollfunc(void (*poll)())
+{
+  dual_poll = poll;
+}
+
+
+// a packet the interpreter has to handle; the buffer is deleted after
+void dual_run(int kind, unsigned char* buf, int len)
+{
+  if (kind == DUAL_BINARY) {
+    ingest_packet(buf, len);
+  } else {
+    buf[len] = 0;
+    forth_run((const char*)buf);
+  }
+  delete[] buf;
+}
+
+
+#ifdef _DUALCORE_
+
+DUALQUEUE dualframes;
+DUALQUEUE dualshown;
+DUALQUEUE dualinput;
+
+// one serial chunk per dualinput slot, so a chunk stays put until read
+char dualchunks[DUAL_QUEUESIZE][DUAL_CHUNK];
+
+TaskHandle_t dualtask = NULL;
+bool dualinflight = false;    // interpreter core only
+int dualstalls = 0;           // io core only
+int dualpackets = 0;          // io core only
+
+
+// io core: put a frame's pixels and show them
+void dual_showframe(DUALITEM* f)
+{
+  unsigned char* px = (unsigned char*)f->data;
+  unsigned long t = micros();
+  for (int i = 0; i < f->b; i++) {
+    unsigned char* p = px + i*3;
+    led_put(f->a, i, (p[0] << 16) | (p[1] << 8) | p[2]);
+  }
+  if (dual_show)
+    (*dual_show)(f->a);
+  DUALITEM done = { px, f->b, (int)(micros() - t) };
+  // only one frame is ever away, so there is always room
+  dual_push(&dualshown, done);
+}
+
+
+// io core: hand over whatever serial input has arrived
+bool dual_serial()
+{
+  if (Serial.available() <= 0)
+    return false;
+  if (dual_full(&dualinput)) {
+    dualstalls++;
+    return false;
+  }
+  char* chunk = dualchunks[dualinput.head & (DUAL_QUEUESIZE - 1)];
+  int n = 0;
+  while (n < DUAL_CHUNK && Serial.available() > 0) {
+    int b = Serial.read();
+    if (b < 0)
+      break;
+    chunk[n++] = (char)b;
+  }
+  if (n == 0)
+    return false;
+  DUALITEM item = { chunk, n, DUAL_SERIAL };
+  dual_push(&dualinput, item);
+  return true;
+}
+
+
+void dual_task(void* arg)
+{
+  for (;;) {
+    bool busy = false;
+    DUALITEM* f = dual_front(&dualframes);
+    if (f) {
+      dual_showframe(f);
+      dual_next(&dualframes);
+      busy = true;
+    }
+    if (dual_serial())
+      busy = true;
+    if (dual_poll)
+      (*dual_poll)();
+    if (!busy)
+      vTaskDelay(1);
+  }
+}
+
+
+// interpreter core: the frame pipeline's handoff
+bool dual_sendframe(unsigned char* px, int slot, int len)
+{
+  if (dualinflight)
+    return false;
+  DUALITEM f = { px, slot, len };
+  if (!dual_push(&dualframes, f))
+    return false;
+  dualinflight = true;
+  return true;
+}
+
+
+// io core: packets of either kind are copied and queued, as decoding one
+// writes to the LED slots and the ingest counters the interpreter owns
+void dual_packet(const unsigned char* buf, int len, bool binary)
+{
+  if (dual_full(&dualinput)) {
+    dualstalls++;
+    return;
+  }
+  unsigned char* copy = new unsigned char[len + 1];
+  memcpy(copy, buf, len);
+  DUALITEM item = { copy, len, binary ? DUAL_BINARY : DUAL_TEXT };
+  dual_push(&dualinput, item);
+  if (binary)
+    dualpackets++;
+}
+
+
+// Frames are only handed to the other core once there is a native show
+// function to run there; until then frame_show puts and shows them on the
+// interpreter core, with the led:show word.
+void dual_showfunc(void (*show)(int slot))
+{
+  dual_show = show;
+  frame_handoff(show ? &dual_sendframe : NULL);
+}
+
+
+void dual_loop()
+{
+  DUALITEM* it = dual_front(&dualshown);
+  if (it) {
+    frame_returned((unsigned char*)it->data, it->a, (unsigned long)it->b);
+    dual_next(&dualshown);
+    dualinflight = false;
+  }
+  // one item of input per pass, as CheckSerial reads one chunk
+  it = dual_front(&dualinput);
+  if (it) {
+    if (it->b == DUAL_SERIAL) {
+      const char* chunk = (const char*)it->data;
+      for (int i = 0; i < it->a; i++)
+        forthduino_input((unsigned char)chunk[i]);
+    } else {
+      dual_run(it->b, (unsigned char*)it->data, it->a);
+    }
+    dual_next(&dualinput);
+  }
+}
+
+
+void op_dual_core()
+{
+  forth_stack()->push((int)xPortGetCoreID());
+}
+
+void op_dual_stalls()
+{
+  forth_stack()->push(dualstalls);
+}
+
+void op_dual_packets()
+{
+  forth_stack()->push(dualpackets);
+}
+
+
+void dual_init()
+{
+  forth_dict()->def("dual:core", &op_dual_core);
+  forth_dict()->def("dual:stalls", &op_dual_stalls);
+  forth_dict()->def("dual:packets", &op_dual_packets);
+  xTaskCreatePinnedToCore(&dual_task, "forth:io", 4096, NULL, 1, &dualtask,
+    1 - xPortGetCoreID());
+}
+
+#else
+
+void dual_showfunc(void (*show)(int slot))
+{
+  dual_show = show;
+}
+
+
+void dual_packet(const unsigned char* buf, int len, bool binary)
+{
+  if (binary) {
+    ingest_packet(buf, len);
+    return;
+  }
+  unsigned char* copy = new unsigned char[len + 1];
+  memcpy(copy, buf, len);
+  dual_run(DUAL_TEXT, copy, len);
+}
+
+
+void dual_loop()
+{
+}
+
+
+void dual_init()
+{
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef forth_dual_h
+#define forth_dual_h
+
+#include "forthduino.h"
+
+// On the dual core ESP32 the interpreter keeps the Arduino loop to itself,
+// and LED output, serial input and packet reception run in a task pinned
+// to the other core. This header needs Arduino.h included before it, so the
+// FreeRTOS config is known.
+#if defined(_ESP32WROVER_) && defined(ESP32) && !defined(CONFIG_FREERTOS_UNICORE)
+#define _DUALCORE_
+#endif
+
+// items each queue between the cores holds, a power of two
+#define DUAL_QUEUESIZE 16
+
+// bytes of serial input handed over at a time
+#define DUAL_CHUNK 64
+
+//
+// Lock-free queue with a single producer and a single consumer, which may
+// be on different cores. The producer only writes head and the consumer
+// only writes tail. The consumer reads the front item in place and calls
+// dual_next once it is done with it, so the producer can't reuse the slot
+// (or anything tied to it) too early.
+//
+struct DUALITEM {
+  void* data;
+  int a;
+  int b;
+};
+
+struct DUALQUEUE {
+  DUALITEM items[DUAL_QUEUESIZE];
+  unsigned int head;  // free running: items pushed
+  unsigned int tail;  // free running: items consumed
+};
+
+bool dual_full(DUALQUEUE* q);
+bool dual_push(DUALQUEUE* q, DUALITEM item);
+DUALITEM* dual_front(DUALQUEUE* q);
+void dual_next(DUALQUEUE* q);
+
+void dual_init();
+
+// on the interpreter core: take back shown frames and run handed over input
+void dual_loop();
+
+// Install the native function that shows an LED slot once its pixels are
+// put; from then on frames are shown with it on the other core, where the
+// led:show word can't be run. Until one is installed, frames are shown on
+// the interpreter core. Install it once, at setup.
+void dual_showfunc(void (*show)(int slot));
+
+// Install a function the other core calls on each pass, e.g. to poll a UDP
+// socket. Packets it receives are given to dual_packet, on that same core.
+void dual_pollfunc(void (*poll)());
+
+// A received packet. With two cores it is copied and queued, and decoded
+// or run by dual_loop on the interpreter core; otherwise it is handled on
+// the spot.
+void dual_packet(const unsigned char* buf, int len, bool binary);
+
+#endif
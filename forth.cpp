@@ -83,8 +83,12 @@ execution stack, operated on, and then the reference is simply dropped.
 Thus the bound sequence (function body) does not have to be cloned or
 deleted. The original sequence is simply used over and over again.
 
-If a bound sequence is dropped from the dictionary, the memory will not be
-cleaned up and a leak will occur. In practice, this never occurs.
+A bound sequence is copied into a region of its own, which holds its
+nested sequences and its values too. The region counts the references to
+it from outside (the dictionary entry, sequence values on the stacks,
+calls compiled into other words), and when the word is forgotten or
+redefined and nothing else refers to it, the whole region is freed at once,
+from the main loop, where it can't still be running.
 
 *********/
 
@@ -100,7 +104,10 @@ cleaned up and a leak will occur. In practice, this never occurs.
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <new>
 #include "forth.h"
+#include "stats.h"
+#include "out.h"
 
 #include "FastLED.h"
 
@@ -114,49 +121,290 @@ struct MEMSTATS {
   int vcurrentfreed;
   int amalloc;
   int afreed;
+  int ashared;
+  int vcapacity;
+  int vslabs;
+  int vhighwater;
+  int apoolhit;
+  int apoolmiss;
+  int spoolhit;
+  int spoolmiss;
+  int sinline;
+  int regions;
+  int rbytes;
 //  int vamalloc;
 //  int vafreed;
 };
 
-MEMSTATS mem = { 0, 0, 0, 0, 0, 0, 0 };
+MEMSTATS mem = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 
 
 // debugging "step" behaviour
 bool step_on = false;
 
+// run compiled sequences through their threaded code, unless disabled or
+// stepping (tracing needs each Value, so it always interprets)
+bool compile_on = true;
+bool run_threaded = true;
+
+// rewrite sequences with the peephole pass when they are closed
+bool optimize_on = true;
+
+// profiler hooks (see prof.cpp), NULL unless profiling is on
+void (*prof_enter_hook)(Value* fv) = NULL;
+void (*prof_exit_hook)() = NULL;
+
+// true when stepping or profiling: runValue and runSequence check only
+// this one flag, and take the slower path that calls the hooks
+bool hooks_on = false;
+
+
+void forth_updatemodes()
+{
+    run_threaded = compile_on && !step_on;
+    hooks_on = step_on || prof_enter_hook != NULL;
+}
+
+
+//
+// String pool: one free list per power-of-two size class. Each buffer
+// starts with a byte giving the class it was allocated from (SPOOL_CLASSES
+// for a string too long to pool), and the string follows it. The length of
+// the string at delete time says nothing about the buffer, as strings are
+// cut short and tokenized in place. A pooled buffer holds the link to the
+// next free buffer in its first bytes, where it stays aligned.
+//
+char* spool[SPOOL_CLASSES];
+int spoolcount[SPOOL_CLASSES];
+
+
+int spoolclass(int size)
+{
+    int c = 0;
+    while ((SPOOL_MINSIZE << c) < size)
+        c++;
+    return c;
+}
+
 
 char* strclone(const char* s)
 {
-    char* cstr = new char[strlen(s) + 1];
-    strcpy(cstr, s);
+    int size = strlen(s) + 1;
+    char* cstr;
+    if (size + 1 > SPOOL_MAXSIZE) {
+        cstr = new char[size + 1] + 1;
+        cstr[-1] = SPOOL_CLASSES;
+    } else {
+        int c = spoolclass(size + 1);
+        if (spool[c]) {
+            mem.spoolhit++;
+            cstr = spool[c] + 1;
+            memcpy(&spool[c], spool[c], sizeof(char*));
+            spoolcount[c]--;
+        } else {
+            mem.spoolmiss++;
+            cstr = new char[SPOOL_MINSIZE << c] + 1;
+        }
+        cstr[-1] = c;
+    }
+    memcpy(cstr, s, size);
     return cstr;
 }
 
 
 char* strdelete(char* s)
 {
-    delete[] s;
+    if (!s)
+        return NULL;
+    char* buf = s - 1;
+    int c = *buf;
+    if (c < SPOOL_CLASSES && spoolcount[c] < SPOOL_DEPTH) {
+        memcpy(buf, &spool[c], sizeof(char*));
+        spool[c] = buf;
+        spoolcount[c]++;
+        return NULL;
+    }
+    delete[] buf;
     return NULL;
 }
 
 
-int* iaclone(const int* ia, int len)
+//
+// Int array pool: each class holds up to APOOL_DEPTH free buffers of one
+// exact length. A class is claimed by the first length released into it,
+// and given up again once it is empty. No more than APOOL_MAXBYTES are
+// kept in all, so one large array can't park its buffers for good.
+//
+struct APOOL {
+    int len;
+    int count;
+    int* bufs[APOOL_DEPTH];
+};
+
+APOOL apool[APOOL_CLASSES];
+int apoolbytes = 0;
+
+
+int* iaalloc(int len)
 {
   mem.amalloc++;
-  int* cpy = new int[len];
+  for (int c = 0; c < APOOL_CLASSES; c++) {
+    if (apool[c].len == len && apool[c].count > 0) {
+      mem.apoolhit++;
+      int* ia = apool[c].bufs[--apool[c].count];
+      apoolbytes -= len*sizeof(int);
+      if (apool[c].count == 0)
+        apool[c].len = 0;
+      return ia;
+    }
+  }
+  mem.apoolmiss++;
+  return new int[len];
+}
+
+
+int* iaclone(const int* ia, int len)
+{
+  int* cpy = iaalloc(len);
   memcpy(cpy, ia, len*sizeof(int));
   return cpy;
 }
 
 
-int* iadelete(int* ia)
+int* iadelete(int* ia, int len)
 {
+  if (!ia)
+    return NULL;
   mem.afreed++;
+  APOOL* empty = NULL;
+  bool room = apoolbytes + len*sizeof(int) <= APOOL_MAXBYTES;
+  for (int c = 0; c < APOOL_CLASSES && len > 0 && room; c++) {
+    if (apool[c].len == len) {
+      if (apool[c].count < APOOL_DEPTH) {
+        apool[c].bufs[apool[c].count++] = ia;
+        apoolbytes += len*sizeof(int);
+        return NULL;
+      }
+      empty = NULL;
+      break;
+    }
+    if (!empty && apool[c].count == 0)
+      empty = &apool[c];
+  }
+  if (empty) {
+    empty->len = len;
+    empty->bufs[empty->count++] = ia;
+    apoolbytes += len*sizeof(int);
+    return NULL;
+  }
   delete[] ia;
   return NULL;
 }
 
 
+// pixel buffers are 3 bytes (r, g, b) per pixel, and start out black
+unsigned char* pxalloc(int len)
+{
+  mem.amalloc++;
+  unsigned char* px = new unsigned char[len*3];
+  memset(px, 0, len*3);
+  return px;
+}
+
+
+unsigned char* pxclone(const unsigned char* px, int len)
+{
+  mem.amalloc++;
+  unsigned char* cpy = new unsigned char[len*3];
+  memcpy(cpy, px, len*3);
+  return cpy;
+}
+
+
+unsigned char* pxdelete(unsigned char* px)
+{
+  if (!px)
+    return NULL;
+  mem.afreed++;
+  delete[] px;
+  return NULL;
+}
+
+
+//
+// Copies of an ARRAY value share one int buffer. The reference count is
+// only allocated the first time a buffer is shared, and a value that has
+// no count is the sole owner of its buffer.
+//
+void iashare(Value* dst, Value* src)
+{
+  if (!src->arefs) {
+    src->arefs = new int;
+    *src->arefs = 1;
+  }
+  (*src->arefs)++;
+  mem.ashared++;
+  dst->ia = src->ia;
+  dst->len = src->len;
+  dst->arefs = src->arefs;
+}
+
+
+// copy-on-write: give v a private buffer if it is currently shared
+int* iamutable(Value* v)
+{
+  if (v->arefs && *v->arefs > 1) {
+    (*v->arefs)--;
+    v->ia = iaclone(v->ia, v->len);
+    v->arefs = NULL;
+  }
+  return v->ia;
+}
+
+
+unsigned char* pxmutable(Value* v)
+{
+  if (v->arefs && *v->arefs > 1) {
+    (*v->arefs)--;
+    v->px = pxclone(v->px, v->len);
+    v->arefs = NULL;
+  }
+  return v->px;
+}
+
+
+void iarelease(Value* v)
+{
+  if (v->arefs) {
+    if (--(*v->arefs) > 0) {
+      v->ia = NULL;
+      v->arefs = NULL;
+      return;
+    }
+    delete v->arefs;
+    v->arefs = NULL;
+  }
+  if (v->vtype == PIXELS)
+    v->px = pxdelete(v->px);
+  else
+    v->ia = iadelete(v->ia, v->len);
+}
+
+
+int pxcolor(Value* v, int i)
+{
+  if (i < 0 || i >= v->len)
+    return 0;
+  if (v->vtype == ARRAY)
+    return v->ia[i];
+  if (v->vtype == PIXELS) {
+    unsigned char* p = v->px + i*3;
+    return (p[0] << 16) | (p[1] << 8) | p[2];
+  }
+  return 0;
+}
+
+
 //Value* vaclone(const Value* va, int len)
 //{
 //  mem.vamalloc++;
@@ -176,22 +424,41 @@ int* iadelete(int* ia)
 
 Value* vfreelist = NULL;
 
+
+// Values come from an arena of slabs, which are allocated whole and never
+// released, so live Values stay packed together instead of being scattered
+// between array buffers on the heap. A fresh slab is threaded onto the free
+// list, which is the only place valloc() takes Values from.
+void vreserve(int n)
+{
+    if (n <= 0)
+        return;
+    Value* slab = new Value[n];
+    for (int i = n - 1; i >= 0; i--) {
+        slab[i].next = vfreelist;
+        vfreelist = &slab[i];
+    }
+    mem.vmalloc += n;
+    mem.vcapacity += n;
+    mem.vcurrentfreed += n;
+    mem.vslabs++;
+}
+
+
 Value* valloc()
 {
-    if (vfreelist) {
-        Value* rs = vfreelist;
-        vfreelist = rs->next;
-        // minimally zero out ptrs and unions
-        memset(rs, 0, sizeof(Value));
-        mem.vallocated++;
-        mem.vcurrentallocated++;
-        mem.vcurrentfreed--;
-        return rs;
-    }
-    mem.vmalloc++;
+    if (!vfreelist)
+        vreserve(VALUE_SLAB_SIZE);
+    Value* rs = vfreelist;
+    vfreelist = rs->next;
+    // callers set vtype and the union members they use
+    rs->next = NULL;
     mem.vallocated++;
     mem.vcurrentallocated++;
-    return new Value();
+    mem.vcurrentfreed--;
+    if (mem.vcurrentallocated > mem.vhighwater)
+        mem.vhighwater = mem.vcurrentallocated;
+    return rs;
 }
 
 
@@ -203,13 +470,19 @@ void vfree(Value* v)
   
   switch(v->vtype) {
     case SEQ:
-      // delete v->seq;
+      seq_release(v->seq);
+      break;
+    case FUNC:
+      if (v->func == &op_call)
+        seq_release(v->seq);
       break;
     case STR:
-      strdelete(v->str);
+      if (v->str != v->sbuf)
+        strdelete(v->str);
       break;
     case ARRAY:
-      iadelete(v->ia);
+    case PIXELS:
+      iarelease(v);
       break;
     default:
       break;
@@ -284,15 +557,15 @@ double Value::asfloat()
 
 char* Value::asstring()
 {
-    char temp[100];
+    char temp[OUT_NUMSIZE];
     char* rs = NULL;
     switch(this->vtype) {
         case INT:
-            sprintf(temp, "%d", this->inum);
+            fmt_int(temp, this->inum);
             rs = strclone(temp);
             break;
         case FLOAT:
-            sprintf(temp, "%f", this->fnum);
+            fmt_float(temp, this->fnum, 6);
             rs = strclone(temp);
             break;
         case STR:
@@ -345,11 +618,24 @@ Value* valloc(double n)
     return rs;
 }
 
+// make v a STR holding a copy of s
+void vsetstr(Value* v, const char* s)
+{
+    v->vtype = STR;
+    size_t size = strlen(s) + 1;
+    if (size <= VALUE_SSO_SIZE) {
+        mem.sinline++;
+        memcpy(v->sbuf, s, size);
+        v->str = v->sbuf;
+    } else {
+        v->str = strclone(s);
+    }
+}
+
 Value* valloc(const char* s)
 {
     Value* rs = valloc();
-    rs->vtype = STR;
-    rs->str = strclone(s);
+    vsetstr(rs, s);
     return rs;
 }
 
@@ -358,6 +644,7 @@ Value* valloc(void(*f)())
     Value* rs = valloc();
     rs->vtype = FUNC;
     rs->func = f;
+    rs->seq = NULL;
     return rs;
 }
 
@@ -367,6 +654,17 @@ Value* valloc(int* i, int ilen)
     rs->vtype = ARRAY;
     rs->ia = i;
     rs->len = ilen;
+    rs->arefs = NULL;
+    return rs;
+}
+
+Value* valloc(unsigned char* px, int plen)
+{
+    Value* rs = valloc();
+    rs->vtype = PIXELS;
+    rs->px = px;
+    rs->len = plen;
+    rs->arefs = NULL;
     return rs;
 }
 
@@ -382,9 +680,11 @@ Value* valloc(Sym* s)
 Value* valloc(ValueStack* s)
 {
     Value* rs = valloc();
-    // takes a reference to the ValueStack, and does not delete it later
+    // takes a reference to the ValueStack, and does not delete it later;
+    // a sequence in a region is kept until the value is freed
     rs->vtype = SEQ;
     rs->seq = s;
+    seq_retain(s);
     return rs;
 }
 
@@ -401,22 +701,26 @@ Value* valloc(Value* obj)
             rs->fnum = obj->fnum;
             break;
         case STR:
-            rs->str = strclone(obj->str);
+            vsetstr(rs, obj->str);
             break;
         case FUNC:
             rs->func = obj->func;
             rs->seq = obj->seq;
+            rs->litarg = obj->litarg;
+            if (rs->func == &op_call)
+                seq_retain(rs->seq);
             break;
         case SEQ:
 //            rs->seq = new ValueStack(obj->seq);
             rs->seq = obj->seq;
+            seq_retain(rs->seq);
             break;
         case SYM:
             rs->sym = obj->sym;
             break;
         case ARRAY:
-            rs->ia = iaclone(obj->ia, obj->len);
-            rs->len = obj->len;
+        case PIXELS:
+            iashare(rs, obj);
             break;
         case FREE:
         default:
@@ -426,58 +730,362 @@ Value* valloc(Value* obj)
 }
 
 
+//
+// Regions hold the sequences bound by def. region_clone works out the size
+// of the whole body first, so it usually fits a single chunk, and freeing
+// the region is a walk of its chunks plus its short list of values that
+// hold something outside it: calls into other regions, and shared array
+// buffers. Values in a region never go through valloc or vfree.
+//
+struct RegionChunk {
+    RegionChunk* next;
+    int size;
+    int used;
+};
+
+// chunk headers are padded so the storage after them stays aligned
+#define REGION_ALIGN 8
+#define REGION_ROUND(n) (((n) + REGION_ALIGN - 1) & ~(REGION_ALIGN - 1))
+#define REGION_HEADER REGION_ROUND((int)sizeof(RegionChunk))
+
+struct FRegion {
+    int refs;
+    bool retired;
+    RegionChunk* chunks;
+    Value* finals;      // linked through next
+    FRegion* nextretired;
+};
+
+FRegion* regionsretired = NULL;
+void (*free_function)(const void* p, int size) = NULL;
+
+
+void* region_alloc(FRegion* r, int size)
+{
+    size = REGION_ROUND(size);
+    RegionChunk* c = r->chunks;
+    if (!c || c->used + size > c->size) {
+        int csize = size > REGION_CHUNK ? size : REGION_CHUNK;
+        c = (RegionChunk*) new char[REGION_HEADER + csize];
+        c->next = r->chunks;
+        c->size = csize;
+        c->used = 0;
+        r->chunks = c;
+        mem.rbytes += REGION_HEADER + csize;
+    }
+    void* p = (char*)c + REGION_HEADER + c->used;
+    c->used += size;
+    return p;
+}
+
+
+// bytes region_copy takes for a sequence, and the code compile adds
+int region_size(ValueStack* src)
+{
+    int cap = 1;
+    while (cap < src->count)
+        cap <<= 1;
+    int n = REGION_ROUND(sizeof(ValueStack)) + REGION_ROUND(cap*sizeof(Value*));
+    if (compile_on)
+        n += REGION_ROUND((src->count > 0 ? src->count : 1)*sizeof(Cell));
+    for (int i = 0; i < src->count; i++) {
+        Value* it = src->at(i);
+        n += REGION_ROUND(sizeof(Value));
+        if (it->vtype == STR && it->str != it->sbuf)
+            n += REGION_ROUND(strlen(it->str) + 1);
+        else if (it->vtype == SEQ)
+            n += region_size(it->seq);
+    }
+    return n;
+}
+
+
+void region_final(FRegion* r, Value* v)
+{
+    v->next = r->finals;
+    r->finals = v;
+}
+
+
+ValueStack* region_copy(FRegion* r, ValueStack* src)
+{
+    ValueStack* seq = new (region_alloc(r, sizeof(ValueStack))) ValueStack(r, src->count);
+    for (int i = 0; i < src->count; i++) {
+        Value* it = src->at(i);
+        Value* v = (Value*)region_alloc(r, sizeof(Value));
+        *v = *it;
+        v->next = NULL;
+        switch (it->vtype) {
+            case STR:
+                if (it->str == it->sbuf) {
+                    v->str = v->sbuf;
+                } else {
+                    int size = strlen(it->str) + 1;
+                    v->str = (char*)region_alloc(r, size);
+                    memcpy(v->str, it->str, size);
+                }
+                break;
+            case SEQ:
+                v->seq = region_copy(r, it->seq);
+                break;
+            case FUNC:
+                if (v->func == &op_call && v->seq) {
+                    seq_retain(v->seq);
+                    region_final(r, v);
+                }
+                break;
+            case ARRAY:
+            case PIXELS:
+                iashare(v, it);
+                region_final(r, v);
+                break;
+            default:
+                break;
+        }
+        seq->items[seq->count++] = v;
+    }
+    return seq;
+}
+
+
+// copy a sequence into a new region, with one reference for the caller
+ValueStack* region_clone(ValueStack* src)
+{
+    FRegion* r = new FRegion;
+    r->refs = 1;
+    r->retired = false;
+    r->chunks = NULL;
+    r->finals = NULL;
+    r->nextretired = NULL;
+    mem.regions++;
+    // one chunk for the copy and its code
+    int size = region_size(src);
+    RegionChunk* c = (RegionChunk*) new char[REGION_HEADER + size];
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    r->chunks = c;
+    mem.rbytes += REGION_HEADER + c->size;
+    return region_copy(r, src);
+}
+
+
+void seq_retain(ValueStack* seq)
+{
+    if (seq && seq->region)
+        seq->region->refs++;
+}
+
+
+void seq_release(ValueStack* seq)
+{
+    if (!seq || !seq->region)
+        return;
+    FRegion* r = seq->region;
+    if (--r->refs == 0 && !r->retired) {
+        r->retired = true;
+        r->nextretired = regionsretired;
+        regionsretired = r;
+    }
+}
+
+
+void region_free(FRegion* r)
+{
+    for (Value* v = r->finals; v; v = v->next) {
+        if (v->vtype == FUNC)
+            seq_release(v->seq);
+        else
+            iarelease(v);
+    }
+    RegionChunk* c = r->chunks;
+    while (c) {
+        RegionChunk* next = c->next;
+        if (free_function)
+            (*free_function)((char*)c + REGION_HEADER, c->size);
+        mem.rbytes -= REGION_HEADER + c->size;
+        delete[] (char*)c;
+        c = next;
+    }
+    mem.regions--;
+    delete r;
+}
+
+
+void forth_reclaim()
+{
+    while (regionsretired) {
+        FRegion* r = regionsretired;
+        regionsretired = r->nextretired;
+        r->retired = false;
+        // it may have been picked up again since it was retired
+        if (r->refs == 0)
+            region_free(r);
+    }
+}
+
+
 ValueStack::ValueStack()
 {
-    head = NULL;
-    tail = NULL;
+    init(VSTACK_DEFAULT_CAPACITY);
+}
+
+
+ValueStack::ValueStack(int initialCapacity)
+{
+    init(initialCapacity);
+}
+
+
+// an empty stack for n values, in the region's storage
+ValueStack::ValueStack(FRegion* r, int n)
+{
+    capacity = 1;
+    while (capacity < n)
+        capacity <<= 1;
+    items = (Value**)region_alloc(r, capacity*sizeof(Value*));
+    first = 0;
+    count = 0;
     mOuter = NULL;
+    code = NULL;
+    mapcode = NULL;
+    mapstate = 0;
+    region = r;
 }
 
 
 ValueStack::ValueStack(ValueStack* src)
 {
-    head = NULL;
-    tail = NULL;
-    mOuter = NULL;
-    Value* itm = src->head;
-    while (itm) {
-        Value* newv = valloc(itm);
-        if (newv->vtype == SEQ)
-            newv->seq = new ValueStack(newv->seq);
-        pushTail(newv);
-        itm = itm->next;
+    init(src->capacity);
+    for (int i = 0; i < src->count; i++) {
+        Value* it = src->at(i);
+        if (it->vtype == SEQ)
+            pushTail(new ValueStack(it->seq));
+        else
+            pushTail(valloc(it));
     }
 }
 
 
 ValueStack::~ValueStack()
 {
-    Value* it = head;
-    while (it) {
-        Value* nxt = it->next;
-        vfree(it);
-        it = nxt;
+    for (int i = 0; i < count; i++)
+        vfree(at(i));
+    delete[] items;
+    delete[] code;
+    delete[] mapcode;
+}
+
+
+void ValueStack::init(int initialCapacity)
+{
+    // capacity is kept to a power of two so ring indexes can be masked
+    capacity = 1;
+    while (capacity < initialCapacity)
+        capacity <<= 1;
+    items = new Value*[capacity];
+    first = 0;
+    count = 0;
+    mOuter = NULL;
+    code = NULL;
+    mapcode = NULL;
+    mapstate = 0;
+    region = NULL;
+}
+
+
+void ValueStack::grow()
+{
+    int ncapacity = capacity << 1;
+    Value** nitems;
+    if (region) {
+        nitems = (Value**)region_alloc(region, ncapacity*sizeof(Value*));
+    } else {
+        nitems = new Value*[ncapacity];
     }
+    for (int i = 0; i < count; i++)
+        nitems[i] = at(i);
+    if (!region)
+        delete[] items;
+    items = nitems;
+    capacity = ncapacity;
+    first = 0;
 }
 
 
 void ValueStack::deleteSequences()
 {
-    Value* it = head;
-    while(it) {
-        if (it->vtype == SEQ) {
+    for (int i = 0; i < count; i++) {
+        Value* it = at(i);
+        if (it->vtype == SEQ && !it->seq->region) {
             it->seq->deleteSequences();
             delete it->seq;
             it->seq = NULL;
             it->vtype = FREE;
         }
-        it = it->next;
     }
 }
 
 
+bool iscontrol(void (*fn)());
+void run_control();
+
+//
+// Compile this sequence, and any nested sequences, to threaded code. Words
+// bound to built-in functions are resolved to the function pointer now, so
+// running a cell is a single indirect call. Control words get run_control,
+// so the interpreter loop can pick them out.
+//
+void ValueStack::compile()
+{
+    uncompile();
+    Cell* ncode;
+    if (region)
+        ncode = (Cell*)region_alloc(region, (count > 0 ? count : 1)*sizeof(Cell));
+    else
+        ncode = new Cell[count > 0 ? count : 1];
+    for (int i = 0; i < count; i++) {
+        Value* it = at(i);
+        // the cells are uninitialized (region memory may even hold
+        // an old body's cells), so every branch sets both fields
+        Value* fv = NULL;
+        if (it->vtype == FUNC)
+            fv = it;
+        else if (it->vtype == SYM && it->sym->value->vtype == FUNC)
+            fv = it->sym->value;
+        if (fv) {
+            ncode[i].func = iscontrol(fv->func) ? &run_control : fv->func;
+            ncode[i].param = fv;
+        } else {
+            if (it->vtype == SEQ)
+                it->seq->compile();
+            ncode[i].func = NULL;
+            ncode[i].param = it;
+        }
+    }
+    code = ncode;
+}
+
+
+void ValueStack::uncompile()
+{
+    // code in a region is freed with the region
+    if (!region) {
+        delete[] code;
+        delete[] mapcode;
+    }
+    code = NULL;
+    mapcode = NULL;
+    mapstate = 0;
+}
+
+
+void peephole(ValueStack* seq);
+
 ValueStack* ValueStack::closeSequence()
 {
+    if (optimize_on)
+        peephole(this);
     if (mOuter) {
         ValueStack* outer = mOuter;
         mOuter = NULL;
@@ -490,21 +1098,24 @@ ValueStack* ValueStack::closeSequence()
 
 void ValueStack::push(Value* v)
 {
-    v->next = head;
-    head = v;
-    if (!tail)
-        tail = v;
+    if (code || mapstate)
+        uncompile();
+    if (count == capacity)
+        grow();
+    first = (first - 1) & (capacity - 1);
+    items[first] = v;
+    count++;
 }
 
 
 void ValueStack::pushTail(Value* v)
 {
-    v->next = NULL;
-    if (tail)
-        tail->next = v;
-    tail = v;
-    if (!head)
-        head = v;
+    if (code || mapstate)
+        uncompile();
+    if (count == capacity)
+        grow();
+    items[(first + count) & (capacity - 1)] = v;
+    count++;
 }
 
 
@@ -608,76 +1219,72 @@ void ValueStack::pushTail(int* ia, int ilen)
 
 Value* ValueStack::pop()
 {
-    Value* rs = head;
-    if (head)
-        head = rs->next;
-    if (!head)
-        tail = NULL;
+    if (count == 0)
+        return NULL;
+    if (code || mapstate)
+        uncompile();
+    Value* rs = items[first];
+    first = (first + 1) & (capacity - 1);
+    count--;
     return rs;
 }
 
 
 Value* ValueStack::top()
 {
-    return head;
+    return count ? items[first] : NULL;
 }
 
 
 Value* ValueStack::back()
 {
-    return tail;
+    return count ? items[(first + count - 1) & (capacity - 1)] : NULL;
 }
 
 
 int ValueStack::size()
 {
-    int sz = 0;
-    Value* it = head;
-    while (it) {
-        sz++;
-        it = it->next;
-    }
-    return sz;
+    return count;
 }
 
 
 Value* ValueStack::at(int n)
 {
-    Value* it = head;
-    while (n > 0 && it) {
-        n--;
-        it = it->next;
-    }
-    return it;
+    if (n < 0 || n >= count)
+        return NULL;
+    return items[(first + n) & (capacity - 1)];
+}
+
+
+void ValueStack::set(int n, Value* v)
+{
+    if (code || mapstate)
+        uncompile();
+    if (n >= 0 && n < count)
+        items[(first + n) & (capacity - 1)] = v;
 }
 
 
 void ValueStack::clear()
 {
-    Value* it = head;
-    while (it) {
-        Value* nxt = it->next;
-        vfree(it);
-        it = nxt;
-    }
-    head = NULL;
-    tail = NULL;
+    if (code || mapstate)
+        uncompile();
+    for (int i = 0; i < count; i++)
+        vfree(at(i));
+    first = 0;
+    count = 0;
 }
 
 
 void ValueStack::reverse()
 {
-    Value* it = head;
-    Value* nhead = NULL;
-    Value* ntail = it;
-    while (it) {
-        Value* nxt = it->next;
-        it->next = nhead;
-        nhead = it;
-        it = nxt;
+    if (code || mapstate)
+        uncompile();
+    for (int i = 0, j = count - 1; i < j; i++, j--) {
+        Value* temp = at(i);
+        set(i, at(j));
+        set(j, temp);
     }
-    head = nhead;
-    tail = ntail;
 }
 
 
@@ -714,6 +1321,23 @@ char* ValueStack::popstring()
 }
 
 
+// Pop a value to be read as a string without a copy being made: the
+// string is the value's str, until the value is vfree'd. A value of any
+// other type is replaced by its string form.
+Value* ValueStack::popstr()
+{
+    Value* rv = pop();
+    if (rv && rv->vtype == STR)
+        return rv;
+    char* rs = rv ? rv->asstring() : strclone("");
+    if (rv)
+        vfree(rv);
+    rv = valloc(rs);
+    strdelete(rs);
+    return rv;
+}
+
+
 ValueStack* ValueStack::popseq()
 {
     Value* rv = pop();
@@ -739,22 +1363,48 @@ ValueStack* forth_stack()
 }
 
 
+void forth_swapstacks(ValueStack** stk, ValueStack** stash)
+{
+    ValueStack* t = vstk;
+    vstk = *stk;
+    *stk = t;
+    t = vstash;
+    vstash = *stash;
+    *stash = t;
+}
+
+
 //
 // Sym and FDict implement the symbol or word dictionary. There is only
 // one global dictionary; this is not a reusable key-value data structure.
 //
-Sym::Sym(const char* w, Value* v)
+Sym::Sym(const char* w, unsigned int h, Value* v)
 {
     next = NULL;
+    prev = NULL;
+    hnext = NULL;
     word = strclone(w);
+    hash = h;
     value = v;
 }
 
 
+// a built-in word's Sym, which keeps the table's name and is never deleted
+Sym::Sym(const FBuiltin* b, unsigned int h)
+{
+    next = NULL;
+    prev = NULL;
+    hnext = NULL;
+    word = b->word;
+    hash = h;
+    value = valloc(b->func);
+}
+
+
 Sym::~Sym()
 {
     strdelete((char*)word);
-    if (value->vtype == SEQ) {
+    if (value->vtype == SEQ && !value->seq->region) {
         value->seq->deleteSequences();
         delete value->seq;
     }
@@ -764,66 +1414,303 @@ Sym::~Sym()
 
 FDict::FDict()
 {
-    head = NULL;
+    init(FDICT_BUCKETS);
 }
 
 
-void FDict::def(const char* word, Value* value)
+FDict::FDict(int nbuckets)
 {
-    if (value->vtype == SEQ)
-        value->seq = new ValueStack(value->seq);
-    Sym* sym = new Sym(word, value);
-    sym->next = head;
-    head = sym;
+    init(nbuckets);
 }
 
 
-void FDict::def(const char* word, void(*func)())
+void FDict::init(int n)
 {
-    Value* v = valloc(func);
-    def(word, v);
+    // bucket count is kept to a power of two so hashes can be masked
+    nbuckets = 1;
+    while (nbuckets < n)
+        nbuckets <<= 1;
+    buckets = new Sym*[nbuckets];
+    memset(buckets, 0, nbuckets*sizeof(Sym*));
+    head = NULL;
+    slots = NULL;
+    bwords = NULL;
+    bindex = NULL;
+    nbuiltins = 0;
 }
 
 
-void FDict::forget(const char* word)
+// FNV-1a, computed once per word and kept in the Sym
+unsigned int FDict::hash(const char* word)
 {
-    Sym* last = NULL;
-    Sym* curr = head;
-    while (curr && strcmp(word, curr->word) != 0) {
-        last = curr;
-        curr = curr->next;
-    }
-    if (curr) {
-        if (last)
-            last->next = curr->next;
-        else
-            head = curr->next;
-        delete curr;
+    unsigned int h = 2166136261u;
+    while (*word) {
+        h ^= (unsigned char)*word++;
+        h *= 16777619u;
     }
+    return h;
 }
 
 
-Sym* FDict::findsym(const char* word)
+// A SEQ value's sequence is copied into a region, unless it is already in
+// one (e.g. it was fetched from another word), which is then shared.
+void FDict::def(const char* word, Value* value)
 {
-    Sym* it = head;
-    while (it) {
-        if (strcmp(word, it->word) == 0)
-            return it;
-        it = it->next;
-    }
-    return NULL;
+    if (value->vtype == SEQ && !value->seq->region)
+        value->seq = region_clone(value->seq);
+    bind(word, value);
 }
 
 
-Value* FDict::find(const char* word)
+// like def, but a SEQ value's sequence is taken over: it is moved into a
+// region and the original is deleted
+void FDict::bind(const char* word, Value* value)
 {
-    Sym* sym = findsym(word);
+    if (value->vtype == SEQ && !value->seq->region) {
+        ValueStack* seq = value->seq;
+        value->seq = region_clone(seq);
+        seq->deleteSequences();
+        delete seq;
+    }
+    if (value->vtype == SEQ && compile_on && !value->seq->code)
+        value->seq->compile();
+    unsigned int h = hash(word);
+    BuiltinWord* bw = findbuiltin(word, h);
+    if (bw)
+        bw->shadows++;
+    Sym* sym = new Sym(word, h, value);
+    sym->next = head;
+    if (head)
+        head->prev = sym;
+    head = sym;
+    Sym** bucket = &buckets[h & (nbuckets - 1)];
+    sym->hnext = *bucket;
+    *bucket = sym;
+    VarSlot* vs = findslot(word, h);
+    if (vs)
+        vs->sym = sym;
+}
+
+
+void FDict::def(const char* word, void(*func)())
+{
+    Value* v = valloc(func);
+    def(word, v);
+}
+
+
+// Add a table of built-in words to the index. A word already in it is
+// replaced, as a later def would shadow it; past FDICT_MAXBUILTINS, words
+// are defined as usual.
+void FDict::builtins(const FBuiltin* table, int n)
+{
+    if (!bwords) {
+        bwords = new BuiltinWord[FDICT_MAXBUILTINS];
+        bindex = new unsigned int[FDICT_BUILTINSLOTS];
+        memset(bindex, 0, FDICT_BUILTINSLOTS*sizeof(unsigned int));
+    }
+    for (int w = 0; w < n; w++) {
+        const FBuiltin* b = &table[w];
+        unsigned int h = hash(b->word);
+        BuiltinWord* bw = findbuiltin(b->word, h);
+        if (bw) {
+            bw->b = b;
+            bw->forgotten = false;
+            if (bw->sym)
+                bw->sym->value->func = b->func;
+            continue;
+        }
+        if (nbuiltins == FDICT_MAXBUILTINS) {
+            def(b->word, b->func);
+            continue;
+        }
+        // open addressing, and the index is never more than half full
+        unsigned int i = h & (FDICT_BUILTINSLOTS - 1);
+        while (bindex[i])
+            i = (i + 1) & (FDICT_BUILTINSLOTS - 1);
+        bw = &bwords[nbuiltins++];
+        bw->b = b;
+        bw->hash = h;
+        bw->sym = NULL;
+        bw->shadows = 0;
+        bw->forgotten = false;
+        for (Sym* it = buckets[h & (nbuckets - 1)]; it; it = it->hnext)
+            if (it->hash == h && strcmp(b->word, it->word) == 0)
+                bw->shadows++;
+        bindex[i] = (h & 0xFFFF0000u) | nbuiltins;
+    }
+}
+
+
+BuiltinWord* FDict::findbuiltin(const char* word, unsigned int h)
+{
+    if (!bindex)
+        return NULL;
+    unsigned int i = h & (FDICT_BUILTINSLOTS - 1);
+    while (bindex[i]) {
+        if ((bindex[i] & 0xFFFF0000u) == (h & 0xFFFF0000u)) {
+            BuiltinWord* bw = &bwords[(bindex[i] & 0xFFFF) - 1];
+            if (bw->hash == h && strcmp(word, bw->b->word) == 0)
+                return bw;
+        }
+        i = (i + 1) & (FDICT_BUILTINSLOTS - 1);
+    }
+    return NULL;
+}
+
+
+// the name of the built-in word bound to func, or NULL
+const char* FDict::builtinname(void(*func)())
+{
+    for (int w = 0; w < nbuiltins; w++)
+        if (bwords[w].b->func == func && !bwords[w].forgotten)
+            return bwords[w].b->word;
+    return NULL;
+}
+
+
+// Forgetting a built-in word only hides it: its Sym stays, as code that
+// was parsed before may still point at it.
+void FDict::forget(const char* word)
+{
+    Sym* curr = unlink(word);
+    unsigned int h = hash(word);
+    BuiltinWord* bw = findbuiltin(word, h);
+    if (curr) {
+        delete curr;
+    } else if (bw && !bw->forgotten) {
+        bw->forgotten = true;
+        VarSlot* vs = findslot(word, h);
+        if (vs)
+            vs->sym = NULL;
+    }
+}
+
+
+// Take the newest definition of a word out of the dictionary, without
+// deleting it. Its next pointer is left as it was, so a walk of the list
+// that is standing on it can still go on.
+Sym* FDict::unlink(const char* word)
+{
+    unsigned int h = hash(word);
+    Sym** link = &buckets[h & (nbuckets - 1)];
+    while (*link && ((*link)->hash != h || strcmp(word, (*link)->word) != 0))
+        link = &(*link)->hnext;
+    Sym* curr = *link;
+    if (!curr)
+        return NULL;
+    BuiltinWord* bw = findbuiltin(word, h);
+    if (bw)
+        bw->shadows--;
+    *link = curr->hnext;
+    if (curr->prev)
+        curr->prev->next = curr->next;
+    else
+        head = curr->next;
+    if (curr->next)
+        curr->next->prev = curr->prev;
+    VarSlot* vs = findslot(word, h);
+    if (vs && vs->sym == curr)
+        vs->sym = findsym(word, h);
+    return curr;
+}
+
+
+Sym* FDict::findsym(const char* word)
+{
+    return findsym(word, hash(word));
+}
+
+
+Sym* FDict::findsym(const char* word, unsigned int h)
+{
+    BuiltinWord* bw = findbuiltin(word, h);
+    if (bw && !bw->shadows) {
+        if (bw->forgotten)
+            return NULL;
+        if (!bw->sym)
+            bw->sym = new Sym(bw->b, h);
+        return bw->sym;
+    }
+    Sym* it = buckets[h & (nbuckets - 1)];
+    while (it) {
+        if (it->hash == h && strcmp(word, it->word) == 0)
+            return it;
+        it = it->hnext;
+    }
+    return NULL;
+}
+
+
+Value* FDict::find(const char* word)
+{
+    Sym* sym = findsym(word);
     if (sym)
         return sym->value;
     return NULL;
 }
 
 
+VarSlot* FDict::findslot(const char* word, unsigned int h)
+{
+    if (!slots)
+        return NULL;
+    VarSlot* it = slots[h & (FDICT_SLOTBUCKETS - 1)];
+    while (it) {
+        if (it->hash == h && strcmp(word, it->word) == 0)
+            return it;
+        it = it->hnext;
+    }
+    return NULL;
+}
+
+
+// the slot for a word, made the first time it is asked for
+VarSlot* FDict::slot(const char* word)
+{
+    if (!slots) {
+        slots = new VarSlot*[FDICT_SLOTBUCKETS];
+        memset(slots, 0, FDICT_SLOTBUCKETS*sizeof(VarSlot*));
+    }
+    unsigned int h = hash(word);
+    VarSlot* vs = findslot(word, h);
+    if (!vs) {
+        vs = new VarSlot;
+        vs->word = strclone(word);
+        vs->hash = h;
+        vs->sym = findsym(word, h);
+        VarSlot** bucket = &slots[h & (FDICT_SLOTBUCKETS - 1)];
+        vs->hnext = *bucket;
+        *bucket = vs;
+    }
+    return vs;
+}
+
+
+// plain data, that nothing else holds a pointer into
+bool isdata(Value* v)
+{
+    return v->vtype == INT || v->vtype == FLOAT || v->vtype == STR
+        || v->vtype == ARRAY || v->vtype == PIXELS;
+}
+
+
+// Define the word of a slot. When both the old and the new value are plain
+// data, the value is swapped in place and the Sym is kept; otherwise the
+// word is forgotten and defined again, as def does.
+void FDict::set(VarSlot* vs, Value* value)
+{
+    Sym* sym = vs->sym;
+    if (sym && isdata(sym->value) && isdata(value)) {
+        vfree(sym->value);
+        sym->value = value;
+        return;
+    }
+    forget(vs->word);
+    def(vs->word, value);
+}
+
+
 
 //
 // Main forth dictionary is 'dict'
@@ -851,18 +1738,149 @@ void runSequence(ValueStack* seq);
 Value* gfuncparams;
 
 
+//
+// An array operand can take the result of an array operation in place when
+// it is not shared and is exactly the length of the result. Elements are
+// read and written at the same index, so overwriting an input is safe.
+//
+bool iareusable(Value* v, int len)
+{
+  return v->vtype == ARRAY && v->len == len && (!v->arefs || *v->arefs == 1);
+}
+
+
+//
+// Fixed point sine for integer degrees, scaled by 1000. Quarter wave table.
+//
+const short isin_table[91] = {
+  0, 17, 35, 52, 70, 87, 105, 122, 139, 156, 174, 191, 208, 225, 242, 259,
+  276, 292, 309, 326, 342, 358, 375, 391, 407, 423, 438, 454, 469, 485, 500,
+  515, 530, 545, 559, 574, 588, 602, 616, 629, 643, 656, 669, 682, 695, 707,
+  719, 731, 743, 755, 766, 777, 788, 799, 809, 819, 829, 839, 848, 857, 866,
+  875, 883, 891, 899, 906, 914, 921, 927, 934, 940, 946, 951, 956, 961, 966,
+  970, 974, 978, 982, 985, 988, 990, 993, 995, 996, 998, 999, 999, 1000, 1000
+};
+
+inline int isin_lut(int deg)
+{
+  deg %= 360;
+  if (deg < 0)
+    deg += 360;
+  if (deg < 90)
+    return isin_table[deg];
+  if (deg < 180)
+    return isin_table[180 - deg];
+  if (deg < 270)
+    return -isin_table[deg - 180];
+  return -isin_table[360 - deg];
+}
+
+
+//
+// Typed kernels for integer arrays. These are selected once per call from
+// the opcode and the operand shape, so the loops carry no per-element type
+// tests or calls through function pointers. An array operand is passed as
+// a pointer, and a scalar operand as a NULL pointer and its value. All array
+// operands must be the full length of the result.
+//
+#define UNARY_LOOP(EXPR) \
+  for (int i = 0; i < len; i++) { int x = pa[i]; rs[i] = (EXPR); } \
+  return true;
+
+bool unary_kernel(int kernel, int* rs, const int* pa, int len)
+{
+  switch(kernel) {
+    case K_ABS: UNARY_LOOP(x < 0 ? -x : x)
+    case K_SQ: UNARY_LOOP(x * x)
+    case K_NOT: UNARY_LOOP(x == 0)
+    case K_ISIN: UNARY_LOOP(isin_lut(x))
+    case K_ICOS: UNARY_LOOP(isin_lut(x + 90))
+    default:
+      return false;
+  }
+}
+
+
+#define BINARY_LOOPS(EXPR) \
+  if (pa && pb) { \
+    for (int i = 0; i < len; i++) { int x = pa[i]; int y = pb[i]; rs[i] = (EXPR); } \
+  } else if (pa) { \
+    int y = sb; \
+    for (int i = 0; i < len; i++) { int x = pa[i]; rs[i] = (EXPR); } \
+  } else { \
+    int x = sa; \
+    for (int i = 0; i < len; i++) { int y = pb[i]; rs[i] = (EXPR); } \
+  } \
+  return true;
+
+bool binary_kernel(int kernel, int* rs, const int* pa, int sa, const int* pb, int sb, int len)
+{
+  switch(kernel) {
+    case K_ADD: BINARY_LOOPS(x + y)
+    case K_SUB: BINARY_LOOPS(x - y)
+    case K_MUL: BINARY_LOOPS(x * y)
+    case K_DIV: BINARY_LOOPS(y == 0 ? 0 : x / y)
+    case K_MOD: BINARY_LOOPS(y == 0 ? 0 : x % y)
+    case K_MIN: BINARY_LOOPS(x < y ? x : y)
+    case K_MAX: BINARY_LOOPS(x > y ? x : y)
+    case K_EQ: BINARY_LOOPS(x == y)
+    case K_NE: BINARY_LOOPS(x != y)
+    case K_GT: BINARY_LOOPS(x > y)
+    case K_LT: BINARY_LOOPS(x < y)
+    case K_GE: BINARY_LOOPS(x >= y)
+    case K_LE: BINARY_LOOPS(x <= y)
+    case K_AND: BINARY_LOOPS(y != 0 ? x : 0)
+    case K_OR: BINARY_LOOPS(x != 0 ? x : y)
+    default:
+      return false;
+  }
+}
+
+
+bool ternary_kernel(int kernel, int* rs, const int* pa, int sa, const int* pb, int sb, const int* pc, int sc, int len)
+{
+  if (kernel != K_CONSTRAIN)
+    return false;
+  if (pa && !pb && !pc) {
+    // the common case: an array constrained to a fixed range
+    for (int i = 0; i < len; i++) {
+      int x = pa[i];
+      rs[i] = x < sb ? sb : (x > sc ? sc : x);
+    }
+  } else {
+    for (int i = 0; i < len; i++) {
+      int x = pa ? pa[i] : sa;
+      int lo = pb ? pb[i] : sb;
+      int hi = pc ? pc[i] : sc;
+      rs[i] = x < lo ? lo : (x > hi ? hi : x);
+    }
+  }
+  return true;
+}
+
+
 //
 // Unary and Binary iterator that handles arrays correctly
 //
-void unary(int(*oper)(int), double(*dbl_oper)(double))
+void unary(int(*oper)(int), double(*dbl_oper)(double), int kernel)
 {
   Value *a = vstk->pop();
   if (a->vtype == ARRAY) {
     int len = a->len;
-    int* rs = new int[len];
-    mem.amalloc++;
-    for (int i = 0; i < len; i++) {
-      rs[i] = (*oper)(a->ia[i]);
+    int* rs;
+    if (iareusable(a, len)) {
+      rs = a->ia;
+    } else {
+      rs = iaalloc(len);
+    }
+    if (!unary_kernel(kernel, rs, a->ia, len)) {
+      for (int i = 0; i < len; i++) {
+        rs[i] = (*oper)(a->ia[i]);
+      }
+    }
+    if (rs == a->ia) {
+      vstk->push(a);
+      return;
     }
     vstk->push(rs, len);
   } else if (a->vtype == INT) {
@@ -874,7 +1892,7 @@ void unary(int(*oper)(int), double(*dbl_oper)(double))
 }
 
 
-void binary(int(*oper)(int,int), double(*dbl_oper)(double,double))
+void binary(int(*oper)(int,int), double(*dbl_oper)(double,double), int kernel)
 {
   Value *b = vstk->pop();
   Value *a = vstk->pop();
@@ -890,12 +1908,23 @@ void binary(int(*oper)(int,int), double(*dbl_oper)(double,double))
     int lb = b->vtype == ARRAY ? b->len : 1;
     int len = la > lb ? la : lb;
 
-    // create result array
-    int* rs = new int[len];
-    mem.amalloc++;
+    // write into an operand's buffer if possible, otherwise create result array
+    Value* keep = iareusable(a, len) ? a : iareusable(b, len) ? b : NULL;
+    int* rs;
+    if (keep) {
+      rs = keep->ia;
+    } else {
+      rs = iaalloc(len);
+    }
+
+    // use a typed kernel when all array operands are full length
+    bool done = !usefloat && (a->vtype != ARRAY || la == len) && (b->vtype != ARRAY || lb == len)
+      && binary_kernel(kernel, rs,
+                       a->vtype == ARRAY ? a->ia : NULL, a->vtype == ARRAY ? 0 : a->asint(),
+                       b->vtype == ARRAY ? b->ia : NULL, b->vtype == ARRAY ? 0 : b->asint(), len);
 
     // iterate over inputs
-    for (int i = 0; i < len; i++) {
+    for (int i = 0; i < len && !done; i++) {
       if (usefloat) {
         double va = a->vtype == ARRAY ? (i < a->len ? (double)a->ia[i] : 0.0) : a->asfloat();
         double vb = b->vtype == ARRAY ? (i < b->len ? (double)b->ia[i] : 0.0) : b->asfloat();
@@ -906,6 +1935,11 @@ void binary(int(*oper)(int,int), double(*dbl_oper)(double,double))
         rs[i] = (*oper)(va, vb);
       }
     }
+    if (keep) {
+      vfree(keep == a ? b : a);
+      vstk->push(keep);
+      return;
+    }
     vstk->push(rs, len);
   } else {
     // no arrays, just call the operator once, either double or int version
@@ -919,7 +1953,7 @@ void binary(int(*oper)(int,int), double(*dbl_oper)(double,double))
 }
 
 
-void ternary(int(*oper)(int,int,int), double(*dbl_oper)(double,double,double))
+void ternary(int(*oper)(int,int,int), double(*dbl_oper)(double,double,double), int kernel)
 {
   Value *c = vstk->pop();
   Value *b = vstk->pop();
@@ -937,12 +1971,24 @@ void ternary(int(*oper)(int,int,int), double(*dbl_oper)(double,double,double))
     int lc = c->vtype == ARRAY ? c->len : 1;
     int len = max(la, max(lb, lc));
 
-    // create result array
-    int* rs = new int[len];
-    mem.amalloc++;
+    // write into an operand's buffer if possible, otherwise create result array
+    Value* keep = iareusable(a, len) ? a : iareusable(b, len) ? b : iareusable(c, len) ? c : NULL;
+    int* rs;
+    if (keep) {
+      rs = keep->ia;
+    } else {
+      rs = iaalloc(len);
+    }
+
+    // use a typed kernel when all array operands are full length
+    bool done = !usefloat && (a->vtype != ARRAY || la == len) && (b->vtype != ARRAY || lb == len) && (c->vtype != ARRAY || lc == len)
+      && ternary_kernel(kernel, rs,
+                        a->vtype == ARRAY ? a->ia : NULL, a->vtype == ARRAY ? 0 : a->asint(),
+                        b->vtype == ARRAY ? b->ia : NULL, b->vtype == ARRAY ? 0 : b->asint(),
+                        c->vtype == ARRAY ? c->ia : NULL, c->vtype == ARRAY ? 0 : c->asint(), len);
 
     // iterate over inputs
-    for (int i = 0; i < len; i++) {
+    for (int i = 0; i < len && !done; i++) {
       if (usefloat) {
         double va = a->vtype == ARRAY ? (i < a->len ? (double)a->ia[i] : 0.0) : a->asfloat();
         double vb = b->vtype == ARRAY ? (i < b->len ? (double)b->ia[i] : 0.0) : b->asfloat();
@@ -955,6 +2001,16 @@ void ternary(int(*oper)(int,int,int), double(*dbl_oper)(double,double,double))
         rs[i] = (*oper)(va, vb, vc);
       }
     }
+    if (keep) {
+      if (keep != a)
+        vfree(a);
+      if (keep != b)
+        vfree(b);
+      if (keep != c)
+        vfree(c);
+      vstk->push(keep);
+      return;
+    }
     vstk->push(rs, len);
   } else {
     // no arrays, just call the operator once, either double or int version
@@ -990,7 +2046,7 @@ double oper_dbl_add(double a, double b)
 
 void op_add()
 {
-    binary(&oper_add, &oper_dbl_add);
+    binary(&oper_add, &oper_dbl_add, K_ADD);
 }
 
 
@@ -1021,7 +2077,7 @@ double oper_dbl_sub(double a, double b)
 
 void op_sub()
 {
-    binary(&oper_sub, &oper_dbl_sub);
+    binary(&oper_sub, &oper_dbl_sub, K_SUB);
 }
 
 
@@ -1037,7 +2093,7 @@ double oper_dbl_mul(double a, double b)
 
 void op_mul()
 {
-    binary(&oper_mul, &oper_dbl_mul);
+    binary(&oper_mul, &oper_dbl_mul, K_MUL);
 }
 
 
@@ -1057,7 +2113,7 @@ double oper_dbl_div(double a, double b)
 
 void op_div()
 {
-    binary(&oper_div, &oper_dbl_div);
+    binary(&oper_div, &oper_dbl_div, K_DIV);
 }
 
 
@@ -1078,7 +2134,7 @@ double oper_dbl_mod(double a, double b)
 
 void op_mod()
 {
-    binary(&oper_mod, &oper_dbl_mod);
+    binary(&oper_mod, &oper_dbl_mod, K_MOD);
 }
 
 
@@ -1110,7 +2166,7 @@ int oper_sq(int a)
 
 void op_sq()
 {
-  unary(&oper_sq, &oper_dbl_sq);
+  unary(&oper_sq, &oper_dbl_sq, K_SQ);
 }
 
 
@@ -1126,7 +2182,7 @@ int oper_constrain(int a, int b, int c)
 
 void op_constrain()
 {
-  ternary(&oper_constrain, &oper_dbl_constrain);
+  ternary(&oper_constrain, &oper_dbl_constrain, K_CONSTRAIN);
 }
 
 
@@ -1142,7 +2198,7 @@ int oper_abs(int a)
 
 void op_abs()
 {
-  unary(&oper_abs, &oper_dbl_abs);
+  unary(&oper_abs, &oper_dbl_abs, K_ABS);
 }
 
 
@@ -1198,7 +2254,7 @@ double oper_dbl_min(double a, double b)
 
 void op_min()
 {
-    binary(&oper_min, &oper_dbl_min);
+    binary(&oper_min, &oper_dbl_min, K_MIN);
 }
 
 
@@ -1214,7 +2270,7 @@ double oper_dbl_max(double a, double b)
 
 void op_max()
 {
-    binary(&oper_max, &oper_dbl_max);
+    binary(&oper_max, &oper_dbl_max, K_MAX);
 }
 
 
@@ -1250,6 +2306,38 @@ void op_cos()
 }
 
 
+int oper_isin(int a)
+{
+  return isin_lut(a);
+}
+
+double oper_dbl_isin(double a)
+{
+  return 1000.0 * oper_dbl_sin(oper_dbl_rad(a));
+}
+
+void op_isin()
+{
+  unary(&oper_isin, &oper_dbl_isin, K_ISIN);
+}
+
+
+int oper_icos(int a)
+{
+  return isin_lut(a + 90);
+}
+
+double oper_dbl_icos(double a)
+{
+  return 1000.0 * oper_dbl_cos(oper_dbl_rad(a));
+}
+
+void op_icos()
+{
+  unary(&oper_icos, &oper_dbl_icos, K_ICOS);
+}
+
+
 double oper_dbl_tan(double a)
 {
   return tan(a);
@@ -1409,13 +2497,14 @@ void op_str_mid()
 {
     int len = vstk->popint();
     int start = vstk->popint();
-    char *inp = vstk->popstring();
+    Value* v = vstk->popstr();
+    char *inp = v->str;
     if (start < (int)strlen(inp)) {
         if ((start+len) < (int)strlen(inp))
             inp[start+len] = 0;
         vstk->push(inp+start);
     }
-    strdelete(inp);
+    vfree(v);
 }
 
 
@@ -1479,10 +2568,9 @@ void op_at()
 
 void op_swap()
 {
-    Value* temp = vstk->head;
-    vstk->head = temp->next;
-    temp->next = vstk->head->next;
-    vstk->head->next = temp;
+    Value* temp = vstk->at(0);
+    vstk->set(0, vstk->at(1));
+    vstk->set(1, temp);
 }
 
 
@@ -1537,30 +2625,24 @@ void op_rup4()
 void op_rotn()
 {
     int n = vstk->popint();
-    Value* h = vstk->head;
-    vstk->head = h->next;
-    Value* after = vstk->head;
-    while (n > 2) {
-        after = after->next;
-        n--;
-    }
-    h->next = after->next;
-    after->next = h;
+    if (n > vstk->size())
+        n = vstk->size();
+    Value* h = vstk->at(0);
+    for (int i = 0; i < n - 1; i++)
+        vstk->set(i, vstk->at(i + 1));
+    vstk->set(n - 1, h);
 }
 
 
 void op_rupn()
 {
     int n = vstk->popint();
-    Value* after = vstk->head;
-    while (n > 2) {
-        after = after->next;
-        n--;
-    }
-    Value* h = after->next;
-    after->next = h->next;
-    h->next = vstk->head;
-    vstk->head = h;
+    if (n > vstk->size())
+        n = vstk->size();
+    Value* h = vstk->at(n - 1);
+    for (int i = n - 1; i > 0; i--)
+        vstk->set(i, vstk->at(i - 1));
+    vstk->set(0, h);
 }
 
 
@@ -1584,6 +2666,14 @@ void op_drop2()
 }
 
 
+void op_nip()
+{
+    Value* v = vstk->pop();
+    vfree(vstk->pop());
+    vstk->push(v);
+}
+
+
 void op_stash()
 {
     Value* v = vstk->pop();
@@ -1609,8 +2699,7 @@ void op_swapstash()
 void op_array()
 {
     int sz = vstk->popint();
-    int* ia = new int[sz];
-    mem.amalloc++;
+    int* ia = iaalloc(sz);
     memset(ia, 0, sz*sizeof(int));
     vstk->push(ia, sz);
 }
@@ -1619,21 +2708,33 @@ void op_array()
 void op_identity()
 {
     Value* v = vstk->top();
-    if (v->vtype == ARRAY)
+    if (v->vtype == ARRAY) {
+        int* ia = iamutable(v);
         for (int i = 0; i < v->len; i++)
-            v->ia[i] = i;
+            ia[i] = i;
+    }
 }
 
 
+bool runMapKernel(ValueStack* block, int* ia, int len);
+
+// set when an error ends the run, see forth_error
+extern bool rabort;
+
 void op_map()
 {
     ValueStack* block = vstk->popseq();
     Value* va = vstk->pop();
     if (va->vtype == ARRAY) {
-        for (int i = 0; i < va->len; i++) {
-            vstk->push(va->ia[i]);
+        int* ia = iamutable(va);
+        if (runMapKernel(block, ia, va->len)) {
+            vstk->push(va);
+            return;
+        }
+        for (int i = 0; i < va->len && !rabort; i++) {
+            vstk->push(ia[i]);
             runSequence(block);
-            va->ia[i] = vstk->popint();
+            ia[i] = vstk->popint();
         }
         vstk->push(va);
     }
@@ -1662,25 +2763,33 @@ void op_puta()
     Value* v = vstk->top();
     if (v->vtype == ARRAY) {
         if (idx >= 0 && idx < v->len)
-            v->ia[idx] = ival;
+            iamutable(v)[idx] = ival;
     }
 }
 
 
+// the dictionary value named by a string value, looked up without taking
+// a copy of the name
+Value* findnamed(Value* name)
+{
+    if (name->vtype == STR)
+        return dict->find(name->str);
+    if (name->vtype == SYM)
+        return name->sym->value;
+    return NULL;
+}
+
+
 void op_dgeta()
 {
     int idx = vstk->popint();
-    char* w = vstk->popstring();
-    Value* v = dict->find(w);
-    if (v->vtype == ARRAY) {
-        if (idx >= 0 && idx < v->len)
-            vstk->push(v->ia[idx]);
-        else
-            vstk->push(0);
-    } else {
+    Value* name = vstk->pop();
+    Value* v = findnamed(name);
+    if (v && v->vtype == ARRAY && idx >= 0 && idx < v->len)
+        vstk->push(v->ia[idx]);
+    else
         vstk->push(0);
-    }
-    strdelete(w);
+    vfree(name);
 }
 
 
@@ -1688,20 +2797,18 @@ void op_dputa()
 {
     int ival = vstk->popint();
     int idx = vstk->popint();
-    char* w = vstk->popstring();
-    Value* v = dict->find(w);
-    if (v->vtype == ARRAY) {
-        if (idx >= 0 && idx < v->len)
-            v->ia[idx] = ival;
-    }
-    strdelete(w);
+    Value* name = vstk->pop();
+    Value* v = findnamed(name);
+    if (v && v->vtype == ARRAY && idx >= 0 && idx < v->len)
+        iamutable(v)[idx] = ival;
+    vfree(name);
 }
 
 
 void op_size()
 {
     Value* v = vstk->top();
-    if (v->vtype == ARRAY)
+    if (v->vtype == ARRAY || v->vtype == PIXELS)
         vstk->push(v->len);
     else
         vstk->push(0);
@@ -1722,7 +2829,7 @@ int oper_eq(int a, int b)
 
 void op_eq()
 {
-  binary(&oper_eq, NULL);
+  binary(&oper_eq, NULL, K_EQ);
 }
 
 
@@ -1733,7 +2840,7 @@ int oper_ne(int a, int b)
 
 void op_ne()
 {
-  binary(&oper_ne, NULL);
+  binary(&oper_ne, NULL, K_NE);
 }
 
 
@@ -1744,7 +2851,7 @@ int oper_gt(int a, int b)
 
 void op_gt()
 {
-  binary(&oper_gt, NULL);
+  binary(&oper_gt, NULL, K_GT);
 }
 
 
@@ -1755,7 +2862,7 @@ int oper_lt(int a, int b)
 
 void op_lt()
 {
-  binary(&oper_lt, NULL);
+  binary(&oper_lt, NULL, K_LT);
 }
 
 
@@ -1766,7 +2873,7 @@ int oper_ge(int a, int b)
 
 void op_ge()
 {
-  binary(&oper_ge, NULL);
+  binary(&oper_ge, NULL, K_GE);
 }
 
 
@@ -1777,7 +2884,7 @@ int oper_le(int a, int b)
 
 void op_le()
 {
-  binary(&oper_le, NULL);
+  binary(&oper_le, NULL, K_LE);
 }
 
 
@@ -1788,7 +2895,7 @@ int oper_and(int a, int b)
 
 void op_and()
 {
-    binary(&oper_and, NULL);
+    binary(&oper_and, NULL, K_AND);
 }
 
 
@@ -1799,7 +2906,7 @@ int oper_or(int a, int b)
 
 void op_or()
 {
-    binary(&oper_or, NULL);
+    binary(&oper_or, NULL, K_OR);
 }
 
 
@@ -1810,7 +2917,7 @@ int oper_not(int a)
 
 void op_not()
 {
-  unary(&oper_not, NULL);
+  unary(&oper_not, NULL, K_NOT);
 }
 
 
@@ -1841,12 +2948,12 @@ void op_loop()
     int begin = vstk->popint();
     ValueStack* block = vstk->popseq();
     if (begin < end) {
-        for (int i = begin; i < end; i++) {
+        for (int i = begin; i < end && !rabort; i++) {
             vstk->push(i);
             runSequence(block);
         }
     } else {
-        for (int i = begin; i > end; i--) {
+        for (int i = begin; i > end && !rabort; i--) {
             vstk->push(i);
             runSequence(block);
         }
@@ -1858,7 +2965,7 @@ void op_repeat()
 {
     int times = vstk->popint();
     ValueStack* block = vstk->popseq();
-    for (int i = 0; i < times; i++) {
+    for (int i = 0; i < times && !rabort; i++) {
         runSequence(block);
     }
 }
@@ -1869,11 +2976,11 @@ void op_call()
     if (gfuncparams->seq) {
         runSequence(gfuncparams->seq);
     } else {
-        char* word = vstk->popstring();
-        Value* dv = dict->find(word);
+        Value* word = vstk->popstr();
+        Value* dv = dict->find(word->str);
+        vfree(word);
         if (dv && dv->vtype == SEQ)
             runSequence(dv->seq);
-        strdelete(word);
     }
 }
 
@@ -1898,52 +3005,69 @@ int __elementAt(Value* v, int i)
 
 void op_redef()
 {
-    char* w = vstk->popstring();
+    Value* w = vstk->popstr();
     Value* v = vstk->pop();
-    dict->def(w, v);
-    strdelete(w);
+    dict->def(w->str, v);
+    vfree(w);
 }
 
 
 void op_forget()
 {
-    char* w = vstk->popstring();
-    dict->forget(w);
-    strdelete(w);
+    Value* w = vstk->popstr();
+    dict->forget(w->str);
+    vfree(w);
 }
 
 
 void op_def()
 {
-    char* w = vstk->popstring();
+    Value* w = vstk->popstr();
     Value* v = vstk->pop();
-    dict->forget(w);
-    dict->def(w, v);
-    strdelete(w);
+    dict->forget(w->str);
+    dict->def(w->str, v);
+    vfree(w);
 }
 
 
 void op_defp()
 {
-    char* word = vstk->popstring();
-    Sym* sym = dict->findsym(word);
+    Value* word = vstk->popstr();
+    Sym* sym = dict->findsym(word->str);
+    vfree(word);
     if (sym)
         vstk->push(1);
     else
         vstk->push(0);
-    strdelete(word);
 }
 
 
 void op_varget()
 {
-    char* word = vstk->popstring();
-    Sym* sym = dict->findsym(word);
+    Value* word = vstk->popstr();
+    Sym* sym = dict->findsym(word->str);
+    vfree(word);
+    if (sym)
+        vstk->push(valloc(sym->value));
+    else
+        vstk->push(0);
+}
+
+
+void op_slotget()
+{
+    Sym* sym = gfuncparams->slot->sym;
     if (sym)
         vstk->push(valloc(sym->value));
     else
         vstk->push(0);
-    strdelete(word);
+}
+
+
+void op_slotput()
+{
+    Value* v = vstk->pop();
+    dict->set(gfuncparams->slot, v);
 }
 
 
@@ -1951,6 +3075,7 @@ void op_step()
 {
     int ison = vstk->popint();
     step_on = (ison != 0);
+    forth_updatemodes();
 }
 
 
@@ -1996,6 +3121,68 @@ void op_mem_afreed()
   vstk->push(mem.afreed);
 }
 
+void op_mem_ashared()
+{
+  vstk->push(mem.ashared);
+}
+
+void op_mem_apoolhit()
+{
+  vstk->push(mem.apoolhit);
+}
+
+void op_mem_apoolmiss()
+{
+  vstk->push(mem.apoolmiss);
+}
+
+void op_mem_spoolhit()
+{
+  vstk->push(mem.spoolhit);
+}
+
+void op_mem_spoolmiss()
+{
+  vstk->push(mem.spoolmiss);
+}
+
+void op_mem_sinline()
+{
+  vstk->push(mem.sinline);
+}
+
+void op_mem_regions()
+{
+  vstk->push(mem.regions);
+}
+
+void op_mem_rbytes()
+{
+  vstk->push(mem.rbytes);
+}
+
+void op_mem_reserve()
+{
+  // grow the Value arena to hold at least n Values, in one slab
+  int n = vstk->popint();
+  vreserve(n - mem.vcapacity);
+}
+
+void op_mem_vcapacity()
+{
+  vstk->push(mem.vcapacity);
+}
+
+void op_mem_vhighwater()
+{
+  vstk->push(mem.vhighwater);
+}
+
+void op_mem_vslabs()
+{
+  vstk->push(mem.vslabs);
+}
+
 #ifdef __arm__
 // should use uinstd.h to define sbrk but Due causes a conflict
 extern "C" char* sbrk(int incr);
@@ -2041,112 +3228,562 @@ void forth_setecho(bool echo)
     cmd_echo = echo;
 }
 
+
+void forth_setcompile(bool compile)
+{
+    compile_on = compile;
+    forth_updatemodes();
+}
+
+
+void forth_setprofiler(void (*enter)(Value* fv), void (*exit)())
+{
+    prof_enter_hook = enter;
+    prof_exit_hook = exit;
+    forth_updatemodes();
+}
+
+
+void forth_freefunction(void (*ff)(const void* p, int size))
+{
+    free_function = ff;
+}
+
+
+void op_compile()
+{
+    int v = forth_stack()->popint();
+    forth_setcompile(v != 0);
+}
+
 //
-// register built-in words
+// Map kernels: a map block made only of int literals, the arithmetic and
+// comparison words, simple stack words, and calls to words made of the
+// same, is compiled once to a short program that runs on a plain int
+// stack. Each element then takes one pass through the program, with no
+// Value allocation and no interpreter dispatch. The block must leave
+// exactly one value and use only values it pushed itself, which is checked
+// at compile time, so the result is identical to running the block.
 //
-void defineBuiltins ()
+enum MAPOPCODE { MOP_END, MOP_LIT, MOP_DUP, MOP_DROP, MOP_SWAP, MOP_OVER, MOP_ROT, MOP_NIP, MOP_DUP2, MOP_DROP2, MOP_UNARY, MOP_BINARY, MOP_TERNARY };
+
+#define MAP_STACK 16
+#define MAP_MAXCODE 64
+#define MAP_MAXNEST 4
+
+const MapWord map_words[] = {
+    { &op_add, MOP_BINARY, K_ADD },
+    { &op_sub, MOP_BINARY, K_SUB },
+    { &op_mul, MOP_BINARY, K_MUL },
+    { &op_div, MOP_BINARY, K_DIV },
+    { &op_mod, MOP_BINARY, K_MOD },
+    { &op_min, MOP_BINARY, K_MIN },
+    { &op_max, MOP_BINARY, K_MAX },
+    { &op_eq, MOP_BINARY, K_EQ },
+    { &op_ne, MOP_BINARY, K_NE },
+    { &op_gt, MOP_BINARY, K_GT },
+    { &op_lt, MOP_BINARY, K_LT },
+    { &op_ge, MOP_BINARY, K_GE },
+    { &op_le, MOP_BINARY, K_LE },
+    { &op_and, MOP_BINARY, K_AND },
+    { &op_or, MOP_BINARY, K_OR },
+    { &op_abs, MOP_UNARY, K_ABS },
+    { &op_sq, MOP_UNARY, K_SQ },
+    { &op_not, MOP_UNARY, K_NOT },
+    { &op_isin, MOP_UNARY, K_ISIN },
+    { &op_icos, MOP_UNARY, K_ICOS },
+    { &op_constrain, MOP_TERNARY, K_CONSTRAIN },
+    { &op_dup, MOP_DUP, 0 },
+    { &op_drop, MOP_DROP, 0 },
+    { &op_swap, MOP_SWAP, 0 },
+    { &op_over, MOP_OVER, 0 },
+    { &op_rot, MOP_ROT, 0 },
+    { &op_nip, MOP_NIP, 0 },
+    { &op_dup2, MOP_DUP2, 0 },
+    { &op_drop2, MOP_DROP2, 0 },
+};
+
+
+// stack inputs and outputs of each map opcode
+const signed char map_inputs[] = { 0, 0, 1, 1, 2, 2, 3, 2, 2, 2, 1, 2, 3 };
+const signed char map_outputs[] = { 0, 1, 2, 0, 2, 3, 3, 1, 4, 0, 1, 1, 1 };
+
+
+const MapWord* forth_mapword(void(*func)())
 {
-  dict->def("+", &op_add);
-  dict->def("-", &op_sub);
-  dict->def("*", &op_mul);
-  dict->def("/", &op_div);
-  dict->def("mod", &op_mod);
-  
-  dict->def("sq", &op_sq);
-  dict->def("sqrt", &op_sqrt);
-  dict->def("constrain", &op_constrain);
-  dict->def("sin", &op_sin);
-  dict->def("cos", &op_cos);
-  dict->def("tan", &op_tan);
-  dict->def("asin", &op_asin);
-  dict->def("acos", &op_acos);
-  dict->def("atan", &op_atan);
-  dict->def("deg", &op_deg);
-  dict->def("rad", &op_rad);
-  dict->def("pow", &op_pow);
-  dict->def("abs", &op_abs);
-
-  dict->def("min", &op_min);
-  dict->def("max", &op_max);
-  dict->def("round", &op_round);
-  dict->def("ceil", &op_ceil);
-  dict->def("floor", &op_floor);
-
-  dict->def("stack:size", &op_stack_size);
-  dict->def("num:dec", &op_num_dec);
-  dict->def("num:sci", &op_num_sci);
-  dict->def("str:mid", &op_str_mid);
-  
-  dict->def("dup", &op_dup);
-  dict->def("over", &op_over);
-  dict->def("aty", &op_aty);
-  dict->def("atz", &op_atz);
-  dict->def("atu", &op_atu);
-  dict->def("atv", &op_atv);
-  dict->def("atw", &op_atw);
-  dict->def("at", &op_at);
-  dict->def("swap", &op_swap);
-  dict->def("rot", &op_rot);
-  dict->def("rup", &op_rup);
-  dict->def("rot4", &op_rot4);
-  dict->def("rup4", &op_rup4);
-  dict->def("rotn", &op_rotn);
-  dict->def("rupn", &op_rupn);
-  dict->def("drop", &op_drop);
-  dict->def("dup2", &op_dup2);
-  dict->def("drop2", &op_drop2);
-  dict->def("clst", &op_clst);
-  
-  dict->def(">>>", &op_stash);
-  dict->def("<<<", &op_unstash);
-  dict->def("<swap>", &op_swapstash);
+    int nwords = sizeof(map_words) / sizeof(map_words[0]);
+    for (int w = 0; w < nwords; w++)
+        if (map_words[w].func == func)
+            return &map_words[w];
+    return NULL;
+}
+
+
+bool addMapOp(MapOp* code, int* ncode, int* depth, int* maxdepth, int op, int arg)
+{
+    if (*ncode >= MAP_MAXCODE - 1 || *depth < map_inputs[op])
+        return false;
+    code[*ncode].op = op;
+    code[*ncode].arg = arg;
+    *depth += map_outputs[op] - map_inputs[op];
+    if (*depth > *maxdepth)
+        *maxdepth = *depth;
+    (*ncode)++;
+    return true;
+}
+
+
+bool compileMapOps(ValueStack* block, MapOp* code, int* ncode, int* depth, int* maxdepth, int nest)
+{
+    for (int i = 0; i < block->count; i++) {
+        Value* it = block->at(i);
+        if (it->vtype == INT) {
+            if (!addMapOp(code, ncode, depth, maxdepth, MOP_LIT, it->inum))
+                return false;
+            continue;
+        }
+        Value* fv = it;
+        if (it->vtype == SYM)
+            fv = it->sym->value;
+        if (fv->vtype != FUNC)
+            return false;
+        if (fv->func == &op_call) {
+            // inline the body of a called word
+            if (!fv->seq || nest >= MAP_MAXNEST)
+                return false;
+            if (!compileMapOps(fv->seq, code, ncode, depth, maxdepth, nest + 1))
+                return false;
+            continue;
+        }
+        if (fv->func == &op_litop) {
+            if (!addMapOp(code, ncode, depth, maxdepth, MOP_LIT, fv->litarg)
+                || !addMapOp(code, ncode, depth, maxdepth, MOP_BINARY, fv->mword->kernel))
+                return false;
+            continue;
+        }
+        const MapWord* mw = forth_mapword(fv->func);
+        if (!mw || !addMapOp(code, ncode, depth, maxdepth, mw->op, mw->kernel))
+            return false;
+    }
+    return true;
+}
+
+
+void compileMapKernel(ValueStack* block)
+{
+    MapOp code[MAP_MAXCODE];
+    int ncode = 0;
+    int depth = 1;
+    int maxdepth = 1;
+    if (!compileMapOps(block, code, &ncode, &depth, &maxdepth, 0) || depth != 1 || maxdepth > MAP_STACK) {
+        block->mapstate = -1;
+        return;
+    }
+    code[ncode].op = MOP_END;
+    code[ncode].arg = 0;
+    if (block->region)
+        block->mapcode = (MapOp*)region_alloc(block->region, (ncode + 1) * sizeof(MapOp));
+    else
+        block->mapcode = new MapOp[ncode + 1];
+    memcpy(block->mapcode, code, (ncode + 1) * sizeof(MapOp));
+    block->mapstate = 1;
+}
+
+
+int kernel_unary(int kernel, int x)
+{
+    int rs;
+    unary_kernel(kernel, &rs, &x, 1);
+    return rs;
+}
+
+
+int kernel_binary(int kernel, int x, int y)
+{
+    int rs;
+    binary_kernel(kernel, &rs, NULL, x, &y, 0, 1);
+    return rs;
+}
+
+
+bool runMapKernel(ValueStack* block, int* ia, int len)
+{
+    if (block->mapstate == 0)
+        compileMapKernel(block);
+    if (block->mapstate != 1)
+        return false;
+    int st[MAP_STACK];
+    for (int i = 0; i < len; i++) {
+        int sp = 0;
+        st[sp++] = ia[i];
+        for (MapOp* mop = block->mapcode; mop->op != MOP_END; mop++) {
+            switch (mop->op) {
+                case MOP_LIT:
+                    st[sp++] = mop->arg;
+                    break;
+                case MOP_DUP:
+                    st[sp] = st[sp-1];
+                    sp++;
+                    break;
+                case MOP_DROP:
+                    sp--;
+                    break;
+                case MOP_SWAP: {
+                    int t = st[sp-1];
+                    st[sp-1] = st[sp-2];
+                    st[sp-2] = t;
+                    break;
+                }
+                case MOP_OVER:
+                    st[sp] = st[sp-2];
+                    sp++;
+                    break;
+                case MOP_ROT: {
+                    // same as op_rot: x y z -> z x y (top moves to third)
+                    int t = st[sp-1];
+                    st[sp-1] = st[sp-2];
+                    st[sp-2] = st[sp-3];
+                    st[sp-3] = t;
+                    break;
+                }
+                case MOP_NIP:
+                    sp--;
+                    st[sp-1] = st[sp];
+                    break;
+                case MOP_DUP2:
+                    st[sp] = st[sp-2];
+                    st[sp+1] = st[sp-1];
+                    sp += 2;
+                    break;
+                case MOP_DROP2:
+                    sp -= 2;
+                    break;
+                case MOP_UNARY:
+                    st[sp-1] = kernel_unary(mop->arg, st[sp-1]);
+                    break;
+                case MOP_BINARY:
+                    sp--;
+                    st[sp-1] = kernel_binary(mop->arg, st[sp-1], st[sp]);
+                    break;
+                case MOP_TERNARY: {
+                    sp -= 2;
+                    int x = st[sp-1], lo = st[sp], hi = st[sp+1];
+                    st[sp-1] = x < lo ? lo : (x > hi ? hi : x);
+                    break;
+                }
+            }
+        }
+        ia[i] = st[0];
+    }
+    return true;
+}
+
+
+//
+// Peephole pass: when a sequence is closed, runs of items are rewritten
+// into fewer, cheaper ones:
+//
+//   literal operands of a pure word     the result, as a literal
+//   (3 4 +, 360 array identity)
+//   dup *                               sq
+//   swap drop                           nip
+//   over over                           dup2
+//   drop drop                           drop2
+//   int literal, binary word            one op_litop superinstruction
+//
+// Each rewrite gives the same result as the items it replaces, for every
+// type of value. cmd:optimize turns the pass off, to compare behaviour.
+//
+#define PEEP_MAXARRAY 2048
+
+void op_litop()
+{
+    Value* fv = gfuncparams;
+    Value* top = vstk->top();
+    if (top && top->vtype == INT) {
+        // the int on top is changed in place, with no Value made or freed
+        top->inum = kernel_binary(fv->mword->kernel, top->inum, fv->litarg);
+        return;
+    }
+    vstk->push(fv->litarg);
+    fv->mword->func();
+}
+
+
+// the built-in word a sequence item runs, or NULL
+Value* peepword(Value* it)
+{
+    if (it->vtype == SYM)
+        it = it->sym->value;
+    if (it->vtype != FUNC || it->func == &op_call || it->func == &op_litop
+        || it->func == &op_slotget || it->func == &op_slotput)
+        return NULL;
+    return it;
+}
+
+
+bool peepliteral(Value* it)
+{
+    return it->vtype == INT || it->vtype == FLOAT
+        || (it->vtype == ARRAY && it->len <= PEEP_MAXARRAY);
+}
+
+
+// operands taken by a word that can be run at parse time, or -1
+int peeppure(Value* fv)
+{
+    if (fv->func == &op_array || fv->func == &op_identity)
+        return 1;
+    const MapWord* mw = forth_mapword(fv->func);
+    if (!mw)
+        return -1;
+    switch (mw->op) {
+        case MOP_UNARY:
+            return 1;
+        case MOP_BINARY:
+            return 2;
+        case MOP_TERNARY:
+            return 3;
+    }
+    return -1;
+}
+
+
+// replace the last n items of out with v
+void peepreplace(Value** out, int* nout, int n, Value* v)
+{
+    for (int i = *nout - n; i < *nout; i++)
+        vfree(out[i]);
+    *nout -= n;
+    out[(*nout)++] = v;
+}
+
+
+// run a pure word on the literals before it, and keep the result instead
+bool peepfold(Value** out, int* nout, Value* fv, int nargs)
+{
+    if (*nout < nargs + 1)
+        return false;
+    Value** args = &out[*nout - nargs - 1];
+    for (int i = 0; i < nargs; i++)
+        if (!peepliteral(args[i]))
+            return false;
+    if (fv->func == &op_array && (args[0]->vtype != INT || args[0]->inum < 0 || args[0]->inum > PEEP_MAXARRAY))
+        return false;
+    int depth = vstk->size();
+    Value* saved = gfuncparams;
+    for (int i = 0; i < nargs; i++)
+        vstk->push(valloc(args[i]));
+    gfuncparams = fv;
+    fv->func();
+    gfuncparams = saved;
+    if (vstk->size() != depth + 1)
+        return false;
+    Value* rs = vstk->pop();
+    if (!peepliteral(rs)) {
+        vfree(rs);
+        return false;
+    }
+    peepreplace(out, nout, nargs + 1, rs);
+    return true;
+}
+
+
+// apply one rewrite to the end of out, if any applies
+bool peepstep(Value** out, int* nout)
+{
+    int n = *nout;
+    if (n < 2)
+        return false;
+    Value* last = peepword(out[n-1]);
+    if (!last)
+        return false;
+    int nargs = peeppure(last);
+    if (nargs > 0 && peepfold(out, nout, last, nargs))
+        return true;
+
+    Value* prev = peepword(out[n-2]);
+    void(*fused)() = NULL;
+    if (prev && prev->func == &op_dup && last->func == &op_mul)
+        fused = &op_sq;
+    else if (prev && prev->func == &op_swap && last->func == &op_drop)
+        fused = &op_nip;
+    else if (prev && prev->func == &op_over && last->func == &op_over)
+        fused = &op_dup2;
+    else if (prev && prev->func == &op_drop && last->func == &op_drop)
+        fused = &op_drop2;
+    if (fused) {
+        peepreplace(out, nout, 2, valloc(fused));
+        return true;
+    }
+
+    const MapWord* mw = forth_mapword(last->func);
+    if (out[n-2]->vtype == INT && mw && mw->op == MOP_BINARY) {
+        Value* v = valloc(&op_litop);
+        v->mword = mw;
+        v->litarg = out[n-2]->inum;
+        peepreplace(out, nout, 2, v);
+        return true;
+    }
+    return false;
+}
+
+
+void peephole(ValueStack* seq)
+{
+    if (seq->count < 2)
+        return;
+    if (seq->code || seq->mapstate)
+        seq->uncompile();
+    Value** out = new Value*[seq->count];
+    int nout = 0;
+    for (int i = 0; i < seq->count; i++) {
+        out[nout++] = seq->at(i);
+        while (peepstep(out, &nout))
+            ;
+    }
+    for (int i = 0; i < nout; i++)
+        seq->items[i] = out[i];
+    seq->first = 0;
+    seq->count = nout;
+    delete[] out;
+}
+
+
+void op_optimize()
+{
+    optimize_on = forth_stack()->popint() != 0;
+}
+
+
+//
+// built-in words
+//
+const FBuiltin forth_words[] PROGMEM = {
+  { "+", &op_add },
+  { "-", &op_sub },
+  { "*", &op_mul },
+  { "/", &op_div },
+  { "mod", &op_mod },
+
+  { "sq", &op_sq },
+  { "sqrt", &op_sqrt },
+  { "constrain", &op_constrain },
+  { "sin", &op_sin },
+  { "cos", &op_cos },
+  { "isin", &op_isin },
+  { "icos", &op_icos },
+  { "tan", &op_tan },
+  { "asin", &op_asin },
+  { "acos", &op_acos },
+  { "atan", &op_atan },
+  { "deg", &op_deg },
+  { "rad", &op_rad },
+  { "pow", &op_pow },
+  { "abs", &op_abs },
+
+  { "min", &op_min },
+  { "max", &op_max },
+  { "round", &op_round },
+  { "ceil", &op_ceil },
+  { "floor", &op_floor },
+
+  { "stack:size", &op_stack_size },
+  { "num:dec", &op_num_dec },
+  { "num:sci", &op_num_sci },
+  { "str:mid", &op_str_mid },
+
+  { "dup", &op_dup },
+  { "over", &op_over },
+  { "aty", &op_aty },
+  { "atz", &op_atz },
+  { "atu", &op_atu },
+  { "atv", &op_atv },
+  { "atw", &op_atw },
+  { "at", &op_at },
+  { "swap", &op_swap },
+  { "rot", &op_rot },
+  { "rup", &op_rup },
+  { "rot4", &op_rot4 },
+  { "rup4", &op_rup4 },
+  { "rotn", &op_rotn },
+  { "rupn", &op_rupn },
+  { "drop", &op_drop },
+  { "dup2", &op_dup2 },
+  { "drop2", &op_drop2 },
+  { "nip", &op_nip },
+  { "clst", &op_clst },
+
+  { ">>>", &op_stash },
+  { "<<<", &op_unstash },
+  { "<swap>", &op_swapstash },
 
   // int array operands
-  dict->def("sum", &op_sum);
-  dict->def("array", &op_array);
-  dict->def("identity", &op_identity);
-  dict->def("geta", &op_geta);
-  dict->def("puta", &op_puta);
-  dict->def("dgeta", &op_dgeta);
-  dict->def("dputa", &op_dputa);
-  dict->def("size", &op_size);
-  dict->def("map", &op_map);
-  
-  dict->def("eq", &op_eq);
-  dict->def("ne", &op_ne);
-  dict->def("gt", &op_gt);
-  dict->def("lt", &op_lt);
-  dict->def("ge", &op_ge);
-  dict->def("le", &op_le);
-  dict->def("and", &op_and);
-  dict->def("or", &op_or);
-  dict->def("not", &op_not);
-
-  dict->def("if", &op_if);
-  dict->def("ife", &op_ife);
-  dict->def("loop", &op_loop);
-  dict->def("repeat", &op_repeat);
-  dict->def("call", &op_call);
-
-  dict->def("def", &op_def);
-  dict->def("redef", &op_redef);
-  dict->def("forget", &op_forget);
-  dict->def("def?", &op_defp);
-  dict->def("vget", &op_varget);
-  dict->def("step", &op_step);
-  
-  dict->def("rb", &op_rb);
+  { "sum", &op_sum },
+  { "array", &op_array },
+  { "identity", &op_identity },
+  { "geta", &op_geta },
+  { "puta", &op_puta },
+  { "dgeta", &op_dgeta },
+  { "dputa", &op_dputa },
+  { "size", &op_size },
+  { "map", &op_map },
+
+  { "eq", &op_eq },
+  { "ne", &op_ne },
+  { "gt", &op_gt },
+  { "lt", &op_lt },
+  { "ge", &op_ge },
+  { "le", &op_le },
+  { "and", &op_and },
+  { "or", &op_or },
+  { "not", &op_not },
+
+  { "if", &op_if },
+  { "ife", &op_ife },
+  { "loop", &op_loop },
+  { "repeat", &op_repeat },
+  { "call", &op_call },
+
+  { "def", &op_def },
+  { "redef", &op_redef },
+  { "forget", &op_forget },
+  { "def?", &op_defp },
+  { "vget", &op_varget },
+  { "step", &op_step },
+
+  { "rb", &op_rb },
+
+  { "mem:malloc", &op_mem_malloc },
+  { "mem:alloc", &op_mem_alloc },
+  { "mem:free", &op_mem_free },
+  { "mem:calloc", &op_mem_calloc },
+  { "mem:cfree", &op_mem_cfree },
+  { "mem:amalloc", &op_mem_amalloc },
+  { "mem:afree", &op_mem_afreed },
+  { "mem:ashare", &op_mem_ashared },
+  { "mem:apool:hit", &op_mem_apoolhit },
+  { "mem:apool:miss", &op_mem_apoolmiss },
+  { "mem:spool:hit", &op_mem_spoolhit },
+  { "mem:spool:miss", &op_mem_spoolmiss },
+  { "mem:sinline", &op_mem_sinline },
+  { "mem:regions", &op_mem_regions },
+  { "mem:rbytes", &op_mem_rbytes },
+  { "mem:reserve", &op_mem_reserve },
+  { "mem:vcap", &op_mem_vcapacity },
+  { "mem:vhigh", &op_mem_vhighwater },
+  { "mem:vslabs", &op_mem_vslabs },
+  { "mem:sram", &op_free_sram },
+
+  { "cmd:echo", &op_echo },
+  { "cmd:compile", &op_compile },
+  { "cmd:optimize", &op_optimize },
+};
 
-  dict->def("mem:malloc", &op_mem_malloc);
-  dict->def("mem:alloc", &op_mem_alloc);
-  dict->def("mem:free", &op_mem_free);
-  dict->def("mem:calloc", &op_mem_calloc);
-  dict->def("mem:cfree", &op_mem_cfree);
-  dict->def("mem:amalloc", &op_mem_amalloc);
-  dict->def("mem:afree", &op_mem_afreed);
-  dict->def("mem:sram", &op_free_sram);
 
-  dict->def("cmd:echo", &op_echo);
+void defineBuiltins ()
+{
+  dict->builtins(forth_words, sizeof(forth_words) / sizeof(forth_words[0]));
 }
 
 
@@ -2158,8 +3795,33 @@ void forth_stepfunction(void(*sf)(Value*))
 }
 
 
+// runValue with stepping or profiling on
+void runValueHooked(Value* it)
+{
+    Value* fv = it;
+    if (it->vtype == SYM && it->sym->value->vtype == FUNC)
+        fv = it->sym->value;
+    if (fv->vtype == FUNC) {
+        if (prof_enter_hook)
+            (*prof_enter_hook)(fv);
+        gfuncparams = fv;
+        fv->func();
+        if (prof_exit_hook)
+            (*prof_exit_hook)();
+    } else {
+        vstk->push(valloc(it));
+    }
+    if (step_on && step_function)
+        (*step_function)(it);
+}
+
+
 void runValue(Value* it)
 {
+    if (hooks_on) {
+        runValueHooked(it);
+        return;
+    }
     if (it->vtype == FUNC) {
         gfuncparams = it;
         it->func();
@@ -2169,24 +3831,328 @@ void runValue(Value* it)
     } else {
         vstk->push(valloc(it));
     }
-    if (step_on && step_function)
-        (*step_function)(it);
 }
 
 
-void runSequence(ValueStack* seq)
+//
+// The return stack. Frames keep a reference on the sequence they run (see
+// seq_retain), so a task's frames stay valid across passes of the main
+// loop even if the words they are in are forgotten.
+//
+RFrame rframes[RSTACK_DEPTH];
+RStack mainrstack = { rframes, 0, RSTACK_DEPTH };
+RStack* rstk = &mainrstack;
+
+// set to end the run: rabort unwinds every frame after an error, ryield
+// stops at the level forth_resume started; rstop is set with either, so
+// the loop checks a single flag after each word
+bool rabort = false;
+bool ryield = false;
+bool rstop = false;
+
+void (*error_function)(const char* msg) = NULL;
+
+
+void forth_errorfunction(void (*ef)(const char* msg))
+{
+    error_function = ef;
+}
+
+
+void forth_error(const char* msg)
+{
+    rabort = true;
+    rstop = true;
+    if (error_function)
+        (*error_function)(msg);
+}
+
+
+void rstack_init(RStack* rs, RFrame* frames, int max)
+{
+    rs->frames = frames;
+    rs->depth = 0;
+    rs->max = max;
+}
+
+
+bool rpush(RStack* rs, int kind, ValueStack* seq, int i, int end)
+{
+    if (rs->depth == rs->max) {
+        forth_error("return stack full");
+        return false;
+    }
+    RFrame* f = &rs->frames[rs->depth++];
+    f->kind = kind;
+    f->seq = seq;
+    f->ip = 0;
+    f->i = i;
+    f->end = end;
+    seq_retain(seq);
+    return true;
+}
+
+
+bool rstack_enter(RStack* rs, ValueStack* seq)
+{
+    return seq && rpush(rs, RF_SEQ, seq, 0, 0);
+}
+
+
+void rstack_unwind(RStack* rs, int base)
+{
+    while (rs->depth > base)
+        seq_release(rs->frames[--rs->depth].seq);
+}
+
+
+void rstack_clear(RStack* rs)
 {
-    Value* it = seq->head;
-    while(it) {
-        runValue(it);
-        it = it->next;
+    rstack_unwind(rs, 0);
+}
+
+
+RStack* forth_setrstack(RStack* rs)
+{
+    RStack* prev = rstk;
+    rstk = rs;
+    return prev;
+}
+
+
+void forth_yield()
+{
+    ryield = true;
+    rstop = true;
+}
+
+
+// The top frame has run its sequence once: true to run it again, or
+// leave it.
+bool rendframe(RStack* rs)
+{
+    RFrame* f = &rs->frames[rs->depth - 1];
+    switch (f->kind) {
+        case RF_REPEAT:
+            if (--f->i > 0) {
+                f->ip = 0;
+                return true;
+            }
+            break;
+        case RF_LOOP:
+            f->i += f->i < f->end ? 1 : -1;
+            if (f->i != f->end) {
+                vstk->push(f->i);
+                f->ip = 0;
+                return true;
+            }
+            break;
     }
+    seq_release(f->seq);
+    rs->depth--;
+    return false;
+}
+
+
+// run a block from the top frame, in its place if that frame is done
+void rcall(RStack* rs, ValueStack* seq)
+{
+    if (!seq)
+        return;
+    RFrame* f = &rs->frames[rs->depth - 1];
+    if (f->kind == RF_SEQ && f->ip >= f->seq->count) {
+        seq_retain(seq);
+        seq_release(f->seq);
+        f->seq = seq;
+        f->ip = 0;
+    } else {
+        rpush(rs, RF_SEQ, seq, 0, 0);
+    }
+}
+
+
+// the interpreter loop's own version of the control words
+void rcontrol(RStack* rs, Value* fv)
+{
+    void (*fn)() = fv->func;
+    if (fn == &op_call) {
+        if (fv->seq) {
+            rcall(rs, fv->seq);
+        } else {
+            Value* word = vstk->popstr();
+            Value* dv = dict->find(word->str);
+            vfree(word);
+            if (dv && dv->vtype == SEQ)
+                rcall(rs, dv->seq);
+        }
+    } else if (fn == &op_if) {
+        int test = vstk->popint();
+        ValueStack* ifblock = vstk->popseq();
+        if (test != 0)
+            rcall(rs, ifblock);
+    } else if (fn == &op_ife) {
+        int test = vstk->popint();
+        ValueStack* elseblock = vstk->popseq();
+        ValueStack* ifblock = vstk->popseq();
+        rcall(rs, test != 0 ? ifblock : elseblock);
+    } else if (fn == &op_repeat) {
+        int times = vstk->popint();
+        ValueStack* block = vstk->popseq();
+        if (times > 0 && block)
+            rpush(rs, RF_REPEAT, block, times, 0);
+    } else if (fn == &op_loop) {
+        int end = vstk->popint();
+        int begin = vstk->popint();
+        ValueStack* block = vstk->popseq();
+        if (begin != end && block) {
+            vstk->push(begin);
+            rpush(rs, RF_LOOP, block, begin, end);
+        }
+    }
+}
+
+
+bool iscontrol(void (*fn)())
+{
+    return fn == &op_call || fn == &op_if || fn == &op_ife
+        || fn == &op_repeat || fn == &op_loop;
+}
+
+
+// Compiled cells for control words call this instead, so the threaded loop
+// finds them with a single compare. Called as a function, it runs the word.
+void run_control()
+{
+    gfuncparams->func();
+}
+
+
+// run the frames of the current return stack above base
+void rrun(int base)
+{
+    RStack* rs = rstk;
+    while (rs->depth > base) {
+        RFrame* f = &rs->frames[rs->depth - 1];
+        ValueStack* seq = f->seq;
+        if (f->ip >= seq->count) {
+            rendframe(rs);
+            continue;
+        }
+        if (seq->code && run_threaded && !hooks_on) {
+            // Run threaded code, following calls, blocks and loops without
+            // leaving this loop, until a word stops the run or the top frame
+            // isn't compiled. f->ip is only kept up to date when control
+            // passes to another frame.
+            Cell* code = seq->code;
+            Cell* c = code + f->ip;
+            Cell* end = code + seq->count;
+            for (;;) {
+                if (c < end) {
+                    void (*fn)() = c->func;
+                    Value* param = c->param;
+                    c++;
+                    if (!fn) {
+                        vstk->push(valloc(param));
+                        continue;
+                    }
+                    if (fn != &run_control) {
+                        gfuncparams = param;
+                        fn();
+                        if (rstop) {
+                            f->ip = c - code;
+                            break;
+                        }
+                        continue;
+                    }
+                    f->ip = c - code;
+                    rcontrol(rs, param);
+                    if (rstop)
+                        break;
+                } else if (rendframe(rs)) {
+                    c = code;
+                    continue;
+                }
+                // the top frame changed
+                if (rs->depth <= base)
+                    break;
+                f = &rs->frames[rs->depth - 1];
+                seq = f->seq;
+                if (!seq->code || !run_threaded || hooks_on)
+                    break;
+                code = seq->code;
+                c = code + f->ip;
+                end = code + seq->count;
+            }
+        } else if (seq->code && run_threaded) {
+            // profiling on (stepping never runs threaded code)
+            Cell* c = seq->code + f->ip++;
+            gfuncparams = c->param;
+            if (c->func) {
+                if (prof_enter_hook)
+                    (*prof_enter_hook)(c->param);
+                c->func();
+                if (prof_exit_hook)
+                    (*prof_exit_hook)();
+            } else {
+                vstk->push(valloc(c->param));
+            }
+        } else {
+            Value* it = seq->at(f->ip++);
+            if (hooks_on) {
+                runValueHooked(it);
+            } else {
+                Value* fv = it;
+                if (it->vtype == SYM && it->sym->value->vtype == FUNC)
+                    fv = it->sym->value;
+                if (fv->vtype != FUNC) {
+                    vstk->push(valloc(it));
+                } else if (iscontrol(fv->func)) {
+                    rcontrol(rs, fv);
+                } else {
+                    gfuncparams = fv;
+                    fv->func();
+                }
+            }
+        }
+        if (rstop) {
+            if (rabort) {
+                rstack_unwind(rs, base);
+                break;
+            }
+            if (base == 0)
+                return;
+        }
+    }
+    if (rs->depth == 0) {
+        rabort = false;
+        rstop = ryield;
+    }
+}
+
+
+void runSequence(ValueStack* seq)
+{
+    if (rabort || !seq)
+        return;
+    int base = rstk->depth;
+    if (rpush(rstk, RF_SEQ, seq, 0, 0))
+        rrun(base);
+}
+
+
+bool forth_resume()
+{
+    ryield = false;
+    rstop = rabort;
+    rrun(0);
+    ryield = false;
+    rstop = rabort;
+    return rstk->depth == 0;
 }
 
 
 // convenience globals for specific words
 Value* word_call;
-Value* word_vget;
 Value* word_def;
 
 
@@ -2204,17 +4170,21 @@ void sigil_endseq(char* w, ValueStack** seq)
 }
 
 
+// @word and !word are bound to the word's slot now, so running them
+// doesn't look the word up
 void sigil_get(char* w, ValueStack** seq)
 {
-    (*seq)->pushTail(w);
-    (*seq)->pushTail(valloc(word_vget));
+    Value* v = valloc(&op_slotget);
+    v->slot = dict->slot(w);
+    (*seq)->pushTail(v);
 }
 
 
 void sigil_put(char* w, ValueStack** seq)
 {
-    (*seq)->pushTail(w);
-    (*seq)->pushTail(valloc(word_def));
+    Value* v = valloc(&op_slotput);
+    v->slot = dict->slot(w);
+    (*seq)->pushTail(v);
 }
 
 
@@ -2299,13 +4269,14 @@ void parseSequenceWord(char* w, ValueStack** seq)
             break;
          default: {
             // check for a defined word
-            Sym* sym = dict->findsym(w);
+            Sym* sym = dict->findsym(w, FDict::hash(w));
             if (sym) {
                 // TODO: this could be simpler and could better account for words that are not yet defined.
                 if (sym->value->vtype == SEQ) {
                     // set up a call() function
                     Value* call = valloc(word_call);
                     call->seq = sym->value->seq;
+                    seq_retain(call->seq);
                     (*seq)->pushTail(call);
                 } else {
                     (*seq)->pushTail(valloc(sym));
@@ -2324,58 +4295,135 @@ void parseSequenceWord(char* w, ValueStack** seq)
 
 
 bool unu_comment = false;
-ValueStack* current_seq = NULL;
 
 void forth_unu(bool state)
 {
   unu_comment = state;
 }
 
-void forth_run(const char* line)
+
+void forth_readinit(FReader* r)
 {
-    if (line[0] == '/' && line[1] == '/') {
-        // comment line, please ignore
-    } else if (line[0] == '~' && line[1] == '~' && line[2] == '~') {
+    r->wlen = 0;
+    r->col = 0;
+    r->wordatstart = false;
+    r->wordcut = false;
+    r->skipline = false;
+    r->truncated = 0;
+    r->seq = NULL;
+    r->linetime = 0;
+    r->parsetime = 0;
+}
+
+
+// a word is complete: parse it, unless the line is a comment
+void forth_readword(FReader* r)
+{
+    if (r->wlen == 0)
+        return;
+    char* w = r->word;
+    w[r->wlen] = 0;
+    r->wlen = 0;
+    if (r->wordatstart && w[0] == '~' && w[1] == '~' && w[2] == '~') {
         unu_comment = !unu_comment;
-    } else if (!unu_comment) {
-        if (current_seq == NULL) {
-            current_seq = new ValueStack();
-        }
-        char* cstr = strclone(line);
-        char* rest = cstr;
-        char* p;
-        while ((p = strtok_r(rest, " ", &rest)) != 0)
-        {
-            parseSequenceWord(p, &current_seq);
+        r->skipline = true;
+    } else if ((r->wordatstart && w[0] == '/' && w[1] == '/') || unu_comment) {
+        // comment line, please ignore
+        r->skipline = true;
+    } else {
+        unsigned long t = micros();
+        if (r->seq == NULL)
+            r->seq = new ValueStack();
+        parseSequenceWord(w, &r->seq);
+        r->parsetime += micros() - t;
+    }
+}
+
+
+// the line is complete: run it, unless a sequence is still open
+void forth_readline(FReader* r)
+{
+    bool empty = r->col == 0;
+    r->col = 0;
+    r->skipline = false;
+    if (r->seq && r->seq->mOuter == NULL) {
+        ValueStack* thisseq = r->seq;
+        r->seq = NULL;
+        unsigned long t = micros();
+        runSequence(thisseq);
+        unsigned long done = micros();
+        thisseq->deleteSequences();
+        delete thisseq;
+        if (!empty) {
+            stat_add(STAT_PARSE, r->parsetime);
+            stat_add(STAT_EXEC, done - t);
+            stat_add(STAT_LATENCY, done - r->linetime);
         }
-        strdelete(cstr);
-        if (current_seq->mOuter == NULL) {
-            ValueStack* thisseq = current_seq;
-            current_seq = NULL;
-            runSequence(thisseq);
-            thisseq->deleteSequences();
-            delete thisseq;
+    }
+    r->parsetime = 0;
+}
+
+
+void forth_read(FReader* r, int b)
+{
+    if (b == '\n' || b == '\r') {
+        if (!r->skipline)
+            forth_readword(r);
+        r->wlen = 0;
+        forth_readline(r);
+        return;
+    }
+    if (r->col == 0)
+        r->linetime = micros();
+    if (!r->skipline) {
+        if (b == ' ') {
+            forth_readword(r);
+        } else if (r->wlen < FREADER_WORDMAX - 1) {
+            if (r->wlen == 0) {
+                r->wordatstart = r->col == 0;
+                r->wordcut = false;
+            }
+            r->word[r->wlen++] = b;
+        } else if (!r->wordcut) {
+            r->wordcut = true;
+            r->truncated++;
         }
     }
+    r->col++;
+}
+
+
+// forth_run reads whole lines, and keeps its place across calls as serial
+// input does, so a definition can span several lines of a file
+FReader linereader;
+
+void forth_run(const char* line)
+{
+    for (const char* p = line; *p; p++)
+        forth_read(&linereader, *p);
+    forth_read(&linereader, '\n');
 }
 
 
+// run a sequence, a line of source, or a word found in the dictionary
 void forth_run(Value* v)
 {
   if (v->vtype == SEQ)
     runSequence(v->seq);
   else if (v->vtype == STR)
     forth_run(v->str);
+  else if (v->vtype == FUNC)
+    runValue(v);
 }
 
 
 void forth_init()
 {
-    vstk = new ValueStack();
-    vstash = new ValueStack();
+    vstk = new ValueStack(VSTACK_EVAL_CAPACITY);
+    vstash = new ValueStack(VSTACK_EVAL_CAPACITY);
     dict = new FDict();
+    forth_readinit(&linereader);
     defineBuiltins();
     word_call = dict->find("call");
-    word_vget = dict->find("vget");
     word_def = dict->find("def");
 }
@@ -8,10 +8,14 @@
 #ifndef forth_h
 #define forth_h
 
-enum VALUETYPE { FREE, INT, FLOAT, STR, FUNC, SEQ, ARRAY, SYM };
+enum VALUETYPE { FREE, INT, FLOAT, STR, FUNC, SEQ, ARRAY, SYM, PIXELS };
 
 class ValueStack;
 class Sym;
+struct FRegion;
+struct VarSlot;
+struct MapWord;
+struct FBuiltin;
 
 //
 // class Value:
@@ -23,28 +27,46 @@ class Sym;
 //    sequence (a Forth sequence, used for loops, conditionals, etc.)
 //    symbol
 //    array of int (used to compute arrays of LED color values)
+//    packed pixels (3 bytes per pixel, r g b, for whole frames of color)
 //    cons (car/cdr pointers) -- not used yet
 // 
 // There are no array, list, or dictionary types. These types are designed
 // to efficiently manage LED appliances.
 //
 
+// A string of up to VALUE_SSO_SIZE - 1 characters is kept inside the Value,
+// in the space the other types use, and str points at it; a longer one is
+// on the heap. Either way str is the string.
+#define VALUE_SSO_SIZE (sizeof(double) + sizeof(void*))
+
 class Value {
 public:
     VALUETYPE vtype;
-    Value* next;
+    Value* next;    // free list link
     union {
         int inum;
         double fnum;
-        char* str;
+        struct {
+            char* str;
+            char sbuf[VALUE_SSO_SIZE];
+        };
         Sym* sym;
         struct {
             void(*func)();
-            ValueStack* seq;
+            union {
+                ValueStack* seq;    // op_call: the sequence called
+                VarSlot* slot;      // @word and !word: the word's slot
+                const MapWord* mword;   // op_litop: the binary word
+            };
+            int litarg;     // op_litop: the int literal
         };
         struct {
             int len;
-            int* ia;
+            union {
+                int* ia;
+                unsigned char* px;
+            };
+            int* arefs;     // shared buffer reference count, NULL if unshared
         };
         struct {
             Value* car;
@@ -64,13 +86,18 @@ public:
 
 
 // valloc and vfree must be used instead of constructed Value objects directly.
-// This allows for the internal management of a free list.
+// This allows for the internal management of a free list, which is fed from
+// an arena of slabs. vreserve adds n Values to the arena as one slab.
+#define VALUE_SLAB_SIZE 64
+
+void vreserve(int n);
 Value* valloc();
 Value* valloc(int n);
 Value* valloc(double n);
 Value* valloc(const char* s);
 Value* valloc(void(*f)());
 Value* valloc(int* i, int ilen);
+Value* valloc(unsigned char* px, int plen);
 //Value* valloc(Value* v, int vlen);
 Value* valloc(Sym* s);
 Value* valloc(ValueStack* s);
@@ -78,18 +105,74 @@ Value* valloc(Value* obj);
 void vfree(Value* v);
 
 
+//
+// struct Cell:
+// One step of a compiled (threaded) sequence. A cell with a func calls it
+// with gfuncparams set to param. A cell without a func is a literal and
+// pushes a copy of param, which is the Value held in the sequence itself.
+//
+struct Cell {
+    void(*func)();
+    Value* param;
+};
+
+
+// one step of the per-element kernel compiled for a map block, see op_map
+struct MapOp {
+    int op;
+    int arg;
+};
+
+// a built-in word that map kernels and the peephole pass know about
+struct MapWord {
+    void(*func)();
+    int op;
+    int kernel;
+};
+
+const MapWord* forth_mapword(void(*func)());
+
+
+//
+// class ValueStack:
+// A stack of Value pointers held contiguously in a ring buffer, so push and
+// pop work at either end, and size() and at(n) are O(1). Position 0 is the
+// top-of-stack (head); the last position is the back (tail). Sequences are
+// built with pushTail and run front to back.
+//
+// A sequence bound by def can be compiled to an array of Cells, one per
+// value, which runSequence dispatches on directly. Any change to the
+// sequence drops the compiled code.
+//
+// A bound sequence lives in a region (see region_clone): the stack, its
+// nested sequences, Values, strings and code are carved from the region's
+// storage, and are never changed or freed one by one.
+//
+#define VSTACK_DEFAULT_CAPACITY 8
+#define VSTACK_EVAL_CAPACITY 64
+
 class ValueStack {
 public:
-    Value* head;
-    Value* tail;
+    Value** items;
+    int first;
+    int count;
+    int capacity;
     ValueStack* mOuter;
+    Cell* code;
+    MapOp* mapcode;
+    int mapstate;   // 0: not analyzed, 1: mapcode is valid, -1: no kernel
+    FRegion* region;    // the region holding this sequence, or NULL
     
     ValueStack();
+    ValueStack(int initialCapacity);
     ValueStack(ValueStack* src);
+    ValueStack(FRegion* r, int n);
     ~ValueStack();
     void deleteSequences();
     
     ValueStack* closeSequence();
+    void compile();
+    void uncompile();
     
     void push(Value* v);
     void push(int vv);
@@ -115,19 +198,44 @@ public:
     int popint();
     double popfloat();
     char* popstring();
+    Value* popstr();
     ValueStack* popseq();
 
     Value* top();
     Value* back();
     int size();
     Value* at(int n);
+    void set(int n, Value* v);
     void clear();
     void reverse();
+
+private:
+    void init(int initialCapacity);
+    void grow();
 };
 
 
 ValueStack* forth_stack();
 
+
+//
+// Regions: region_clone copies a sequence and everything under it into one
+// block of storage, which is freed as a whole when the region has no more
+// references. References are counted for the dictionary entry or task that
+// owns the body, for SEQ values and calls to it held anywhere outside it,
+// and for task frames running it; seq_retain and seq_release count one for
+// the region a sequence is in, and do nothing for a sequence that isn't in
+// one. A region whose last reference goes is only retired: forth_reclaim
+// frees it, and must be called where no sequence can be running, such as
+// the top of the main loop.
+//
+#define REGION_CHUNK 512
+
+ValueStack* region_clone(ValueStack* src);
+void seq_retain(ValueStack* seq);
+void seq_release(ValueStack* seq);
+void forth_reclaim();
+
 void forth_stepfunction(void(*sf)(Value*));
 
 
@@ -135,47 +243,265 @@ void forth_stepfunction(void(*sf)(Value*));
 class Sym {
 public:
     const char* word;
+    unsigned int hash;
     Value* value;
-    Sym* next;
+    Sym* next;      // dictionary order, newest first
+    Sym* prev;
+    Sym* hnext;     // hash bucket chain, newest first
 
-    Sym(const char* w, Value* v);
+    Sym(const char* w, unsigned int h, Value* v);
+    Sym(const FBuiltin* b, unsigned int h);
     ~Sym();
 };
 
 
+//
+// struct FBuiltin:
+// Built-in words are listed in constant tables, one per module, which stay
+// in flash. FDict::builtins adds a table to the dictionary's index without
+// allocating anything per word; a word's Sym (and its FUNC value) is made
+// the first time the word is looked up, and lasts as long as the program.
+// Built-ins are looked up first; a word defined with def under the same
+// name is counted in shadows, and while there is one it is found instead.
+//
+#define FDICT_MAXBUILTINS 256
+#define FDICT_BUILTINSLOTS 512  // index size, a power of two
+
+struct FBuiltin {
+    const char* word;
+    void (*func)();
+};
+
+struct BuiltinWord {
+    const FBuiltin* b;
+    unsigned int hash;
+    Sym* sym;       // NULL until the word is first looked up
+    unsigned short shadows;
+    bool forgotten;
+};
+
+
+//
+// struct VarSlot:
+// A handle on a word that @word and !word are bound to when they are
+// parsed. It lasts as long as the program and always points at the word's
+// current definition (or NULL), so the word can be defined, forgotten or
+// redefined after the code that uses it was parsed.
+//
+struct VarSlot {
+    const char* word;
+    unsigned int hash;
+    Sym* sym;
+    VarSlot* hnext;
+};
+
+
+//
+// class FDict:
+// Words are kept in hash buckets for lookup, and in a single list (newest
+// first) for walking the whole dictionary. A newer definition of a word is
+// always found before an older one, so redef shadows and forget uncovers.
+//
+#define FDICT_BUCKETS 256
+#define FDICT_SLOTBUCKETS 64
+
 class FDict {
 public:
     Sym* head;
+    Sym** buckets;
+    int nbuckets;
+    VarSlot** slots;    // made on the first call to slot()
+    BuiltinWord* bwords;    // made on the first call to builtins()
+    int nbuiltins;
 
     FDict();
+    FDict(int nbuckets);
     
+    static unsigned int hash(const char* word);
+
     void def(const char* word, Value* value);
     void def(const char* word, void(*func)());
+    void builtins(const FBuiltin* table, int n);
+    const char* builtinname(void(*func)());
+    void bind(const char* word, Value* value);
     void forget(const char* word);
+    Sym* unlink(const char* word);
     Sym* findsym(const char* word);
+    Sym* findsym(const char* word, unsigned int h);
     Value* find(const char* word);
+    VarSlot* slot(const char* word);
+    void set(VarSlot* slot, Value* value);
+
+private:
+    // by hash: the word's bwords index + 1 in the low half (0 for none),
+    // and the top half of its hash, so most misses don't touch bwords
+    unsigned int* bindex;
+
+    void init(int nbuckets);
+    VarSlot* findslot(const char* word, unsigned int h);
+    BuiltinWord* findbuiltin(const char* word, unsigned int h);
 };
 
 
 FDict* forth_dict();
 
+// Array and string buffers are recycled through small pools. Int arrays
+// are pooled by exact length (frames come in a few fixed sizes), up to
+// APOOL_MAXBYTES in all, strings by the power-of-two size class they were
+// allocated from, up to SPOOL_MAXSIZE bytes.
+#define APOOL_CLASSES 8
+#define APOOL_DEPTH 4
+#define APOOL_MAXBYTES (32 * 1024)
+#define SPOOL_CLASSES 4
+#define SPOOL_MINSIZE 16
+#define SPOOL_MAXSIZE (SPOOL_MINSIZE << (SPOOL_CLASSES - 1))
+#define SPOOL_DEPTH 16
+
 char* strclone(const char* s);
 char* strdelete(char* s);
+int* iaalloc(int len);
 int* iaclone(const int* ia, int len);
-int* iadelete(int* ia);
+int* iadelete(int* ia, int len);
+
+unsigned char* pxalloc(int len);
+unsigned char* pxclone(const unsigned char* px, int len);
+unsigned char* pxdelete(unsigned char* px);
+
+// ARRAY and PIXELS values share their buffer when copied. Words that change
+// an array in place must call iamutable (or pxmutable) first to get a
+// private copy when the buffer is shared.
+void iashare(Value* dst, Value* src);
+int* iamutable(Value* v);
+unsigned char* pxmutable(Value* v);
+void iarelease(Value* v);
+
+// packed 0xRRGGBB color of element i of an ARRAY or PIXELS value
+int pxcolor(Value* v, int i);
 //Value* vaclone(const Value* va, int len);
 //Value* vadelete(Value* va, int len);
 
+// Array kernels: an operator can name one of these so unary/binary/ternary
+// run a typed loop over integer arrays instead of calling oper per element.
+enum KERNEL {
+    KERNEL_NONE,
+    K_ADD, K_SUB, K_MUL, K_DIV, K_MOD, K_MIN, K_MAX,
+    K_EQ, K_NE, K_GT, K_LT, K_GE, K_LE, K_AND, K_OR,
+    K_ABS, K_SQ, K_NOT, K_ISIN, K_ICOS,
+    K_CONSTRAIN
+};
+
 // process implicit array arguments
-void unary(int(*oper)(int), double(*dbl_oper)(double));
-void binary(int(*oper)(int,int), double(*dbl_oper)(double,double));
-void ternary(int(*oper)(int,int,int), double(*dbl_oper)(double,double,double));
+void unary(int(*oper)(int), double(*dbl_oper)(double), int kernel = KERNEL_NONE);
+void binary(int(*oper)(int,int), double(*dbl_oper)(double,double), int kernel = KERNEL_NONE);
+void ternary(int(*oper)(int,int,int), double(*dbl_oper)(double,double,double), int kernel = KERNEL_NONE);
+
 
+//
+// struct FReader:
+// Incremental reader for Forth source text. Bytes are fed in as they
+// arrive, and each word is parsed as soon as the space after it comes in.
+// A line runs at its newline if it leaves no sequence or definition open,
+// otherwise the open sequence carries on into the next line. Only the word
+// being read is buffered, so lines can be any length; a word longer than
+// FREADER_WORDMAX - 1 characters is cut short.
+//
+#define FREADER_WORDMAX 256
+
+struct FReader {
+    char word[FREADER_WORDMAX];
+    int wlen;
+    int col;            // bytes read on this line so far
+    bool wordatstart;   // the word being read began the line
+    bool wordcut;       // the word being read is too long
+    bool skipline;      // the rest of the line is a comment
+    int truncated;      // number of words cut short
+    ValueStack* seq;    // the top level sequence being read
+    unsigned long linetime;     // micros() at the first byte of the line
+    unsigned long parsetime;    // microseconds spent parsing the line
+};
+
+void forth_readinit(FReader* r);
+void forth_read(FReader* r, int b);
 
 void forth_init();
 void forth_run(const char* line);
 void forth_run(Value* v);
+void runValue(Value* it);
+void runSequence(ValueStack* seq);
+
+// exchange the evaluation and stash stacks with the ones given, so a task
+// can run on its own stacks and put them back afterwards
+void forth_swapstacks(ValueStack** stk, ValueStack** stash);
+
+//
+// struct RStack:
+// Sequences are run from an explicit return stack of frames rather than by
+// recursing through C. Calls to defined words, if/ife blocks and the blocks
+// of loop and repeat each get a frame, and a call or if/ife that ends a
+// sequence replaces its frame (a tail call), so a word ending in a call to
+// itself runs in constant depth. A sequence nested deeper than the stack
+// allows is an error: it is reported to the error function and the run is
+// abandoned, down to where it started.
+//
+// Each task has its own return stack. A task's run stops at a yield with
+// its frames intact, and forth_resume carries on from there.
+//
+#define RSTACK_DEPTH 256
+
+enum RFRAMEKIND { RF_SEQ, RF_REPEAT, RF_LOOP };
+
+struct RFrame {
+    int kind;
+    ValueStack* seq;
+    int ip;
+    int i;      // RF_REPEAT: runs left, RF_LOOP: loop index
+    int end;    // RF_LOOP only
+};
+
+struct RStack {
+    RFrame* frames;
+    int depth;
+    int max;
+};
+
+void rstack_init(RStack* rs, RFrame* frames, int max);
+// push a sequence to run; false (and an error) if the stack is full
+bool rstack_enter(RStack* rs, ValueStack* seq);
+// drop every frame
+void rstack_clear(RStack* rs);
+
+// make rs the return stack sequences run on, and return the previous one
+RStack* forth_setrstack(RStack* rs);
+// run the current return stack until it is empty or a yield; true if empty
+bool forth_resume();
+// stop the run at the next word, keeping its frames, if it was started by
+// forth_resume
+void forth_yield();
+void forth_errorfunction(void (*ef)(const char* msg));
+
+// control words run by the interpreter loop itself; called as functions
+// (e.g. with profiling on) they run their block with runSequence
+void op_call();
+void op_if();
+void op_ife();
+void op_loop();
+void op_repeat();
+
+// variable read and write bound to a VarSlot, compiled from @word and !word
+void op_slotget();
+void op_slotput();
+
+// an int literal fused with the binary word after it, by the peephole pass
+void op_litop();
+
 void forth_unu(bool state);
+void forth_setcompile(bool compile);
+
+// call enter before and exit after each word run, or pass NULLs to stop
+void forth_setprofiler(void (*enter)(Value* fv), void (*exit)());
+// called with each block of storage a freed region gives back, before it
+// can be reused for another word's body
+void forth_freefunction(void (*ff)(const void* p, int size));
 bool forth_getecho();
 void forth_setecho(bool echo);
 
@@ -7,6 +7,10 @@
 #include "Adafruit_LEDBackpack.h"
 
 #include "forth.h"
+#include "prof.h"
+#include "stats.h"
+#include "out.h"
+#include "dual.h"
 
 
 
@@ -15,6 +19,12 @@
 //
 FDict* looptasks;
 
+// A loop task may forget itself, or another task, while the loop is
+// walking the tasks. Tasks forgotten during a pass are only taken out of
+// looptasks, chained here by hnext, and deleted once the pass is over.
+bool loopwalking = false;
+Sym* loopdead = NULL;
+
 
 void opRndm()
 {
@@ -98,32 +108,37 @@ void prtvalue(Value* v)
 {
   switch(v->vtype) {
     case FREE:
-      Serial.print("<free>");
+      out_str("<free>");
       break;
     case INT:
-      Serial.print(v->inum);
+      out_int(v->inum);
       break;
     case FLOAT:
-      Serial.print(v->fnum);
+      out_float(v->fnum, 2);
       break;
     case STR:
-      Serial.print(v->str);
+      out_str(v->str);
       break;
     case FUNC:
-      Serial.print("<func>");
+      out_str("<func>");
       break;
     case SEQ:
-      Serial.print("<seq>");
+      out_str("<seq>");
       break;
     case ARRAY:
-      Serial.print("<int[");
-      Serial.print(v->len);
-      Serial.print("]>");
+      out_str("<int[");
+      out_int(v->len);
+      out_str("]>");
       break;
     case SYM:
-      Serial.print("<");
-      Serial.print(v->sym->word);
-      Serial.print(">");
+      out_str("<");
+      out_str(v->sym->word);
+      out_str(">");
+      break;
+    case PIXELS:
+      out_str("<px[");
+      out_int(v->len);
+      out_str("]>");
       break;
   }
 }
@@ -132,53 +147,81 @@ void dot()
 {
   Value* v = forth_stack()->pop();
   prtvalue(v);
-  Serial.print(" ");
+  out_str(" ");
   vfree(v);
 }
 
 void prtdict()
 {
-  Sym* sym = forth_dict()->head;
+  FDict* d = forth_dict();
+  Sym* sym = d->head;
   while (sym) {
-    Serial.print(sym->word);
-    Serial.print(": ");
+    out_str(sym->word);
+    out_str(": ");
     prtvalue(sym->value);
-    Serial.println();
+    out_line();
     sym = sym->next;
   }
+  for (int w = 0; w < d->nbuiltins; w++) {
+    if (d->bwords[w].forgotten)
+      continue;
+    out_str(d->bwords[w].b->word);
+    out_str(": <func>");
+    out_line();
+  }
 }
 
 void cr()
 {
-  Serial.println("");
+  out_line();
 }
 
 void prtstk()
 {
-  Value* itm = forth_stack()->head;
-  while (itm)
+  ValueStack* stk = forth_stack();
+  for (int i = 0; i < stk->size(); i++)
   {
-    prtvalue(itm);
-    Serial.print(" ");
-    itm = itm->next;
+    prtvalue(stk->at(i));
+    out_str(" ");
   }
-  Serial.println();
+  out_line();
+}
+
+void loop_remove(const char* word)
+{
+    if (!loopwalking) {
+        looptasks->forget(word);
+        return;
+    }
+    Sym* task = looptasks->unlink(word);
+    if (task) {
+        task->hnext = loopdead;
+        loopdead = task;
+    }
+}
+
+bool loop_isdead(Sym* task)
+{
+    for (Sym* d = loopdead; d; d = d->hnext)
+        if (d == task)
+            return true;
+    return false;
 }
 
 void op_loopdef()
 {
-    char* w = forth_stack()->popstring();
+    Value* w = forth_stack()->popstr();
     Value* v = forth_stack()->pop();
-    looptasks->forget(w);
-    looptasks->def(w, v);
-    strdelete(w);
+    loop_remove(w->str);
+    looptasks->def(w->str, v);
+    vfree(w);
 }
 
 void op_loopforget()
 {
-    char* w = forth_stack()->popstring();
-    looptasks->forget(w);
-    strdelete(w);
+    Value* w = forth_stack()->popstr();
+    loop_remove(w->str);
+    vfree(w);
 }
 
 
@@ -186,36 +229,155 @@ void op_loopforget()
 void step_serial(Value* lastword)
 {
     prtvalue(lastword);
-    Serial.print(": ");
+    out_str(": ");
     prtstk();
 }
 
 
-char serinput[1024];
-int serlen = 0;
+void error_serial(const char* msg)
+{
+    out_str("error: ");
+    out_str(msg);
+    out_line();
+}
+
+
+// bytes read from serial on each pass of the loop, so long input is
+// parsed a piece at a time between other work
+#define SERIAL_CHUNK 64
+
+FReader serreader;
+bool serlinestart = true;
+
+
+void forthduino_input(int b)
+{
+  if (forth_getecho()) {
+    if (serlinestart)
+      out_str("serial>");
+    if (b == 10 || b == 13)
+      out_line();
+    else
+      out_char((char)b);
+  }
+  serlinestart = b == 10 || b == 13;
+  forth_read(&serreader, b);
+}
 
 
 bool CheckSerial()
 {
-  while (Serial.available() > 0) {
+  int n = 0;
+  while (n < SERIAL_CHUNK && Serial.available() > 0) {
     int b = Serial.read();
-    if (b == 10 || b == 13) {
-      serinput[serlen] = 0;
-      if (forth_getecho()) {
-        Serial.print("serial>");
-        Serial.println(serinput);
-      }
-      forth_run(serinput);
-      serlen = 0;
-    } else {
-      serinput[serlen++] = b;
-    }
-    return true;
+    if (b < 0)
+      break;
+    forthduino_input(b);
+    n++;
+  }
+  return n > 0;
+}
+
+
+
+//
+// Quad 14 segment displays: one driver per (bus, address) is kept for the
+// life of the program, so the HT16K33 is set up only once. The digits last
+// sent are remembered, and a flush writes just the run of digits that
+// changed, as a single I2C transaction. With quad:async on, quad:char and
+// quad:str only update the digits and the loop flushes them.
+//
+#define QUAD_MAX 12
+#define QUAD_DIGITS 4
+
+struct QUADDISPLAY {
+  TwoWire* bus;
+  int addr;
+  Adafruit_AlphaNum4 a4;
+  uint16_t shown[QUAD_DIGITS];
+  bool pending;
+};
+
+QUADDISPLAY quads[QUAD_MAX];
+int nquads = 0;
+bool quadasync = false;
+
+
+TwoWire* quad_bus(int widx)
+{
+  switch(widx) {
+    case 1:
+      return &Wire1;
+    case 2:
+      return &Wire2;
+  }
+  return &Wire;
+}
+
+
+QUADDISPLAY* quad_get(int widx, int addr)
+{
+  TwoWire* bus = quad_bus(widx);
+  for (int i = 0; i < nquads; i++)
+    if (quads[i].bus == bus && quads[i].addr == addr)
+      return &quads[i];
+  if (nquads == QUAD_MAX)
+    return NULL;
+  QUADDISPLAY* q = &quads[nquads++];
+  q->bus = bus;
+  q->addr = addr;
+  q->a4.begin(addr, bus);
+  // what the display shows after begin is unknown, so send every digit
+  for (int i = 0; i < QUAD_DIGITS; i++) {
+    q->a4.displaybuffer[i] = 0;
+    q->shown[i] = 0xFFFF;
+  }
+  q->pending = false;
+  return q;
+}
+
+
+void quad_flush(QUADDISPLAY* q)
+{
+  q->pending = false;
+  int first = 0;
+  while (first < QUAD_DIGITS && q->a4.displaybuffer[first] == q->shown[first])
+    first++;
+  if (first == QUAD_DIGITS)
+    return;
+  int last = QUAD_DIGITS - 1;
+  while (q->a4.displaybuffer[last] == q->shown[last])
+    last--;
+
+  // the HT16K33 steps its RAM address after each byte, two bytes a digit
+  q->bus->beginTransmission(q->addr);
+  q->bus->write((uint8_t)(first * 2));
+  for (int i = first; i <= last; i++) {
+    uint16_t d = q->a4.displaybuffer[i];
+    q->bus->write((uint8_t)(d & 0xFF));
+    q->bus->write((uint8_t)(d >> 8));
+    q->shown[i] = d;
   }
-  return false;
+  q->bus->endTransmission();
 }
 
 
+void quad_update(QUADDISPLAY* q)
+{
+  if (quadasync)
+    q->pending = true;
+  else
+    quad_flush(q);
+}
+
+
+void quad_loop()
+{
+  for (int i = 0; i < nquads; i++)
+    if (quads[i].pending)
+      quad_flush(&quads[i]);
+}
+
 
 // [ [  '**** quad:str ] #70 #73 loop ] 0 3 loop
 void op_quad_char()
@@ -225,47 +387,28 @@ void op_quad_char()
   int addr = forth_stack()->popint();
   int widx = forth_stack()->popint();
 
-  Adafruit_AlphaNum4 a4 = Adafruit_AlphaNum4();
-  switch(widx) {
-    case 0:
-      a4.begin(addr, &Wire);
-      break;
-    case 1:
-      a4.begin(addr, &Wire1);
-      break;
-    case 2:
-      a4.begin(addr, &Wire2);
-      break;
-  }
-  
-
-  a4.writeDigitAscii(pos, c);
-  a4.writeDisplay();
+  QUADDISPLAY* q = quad_get(widx, addr);
+  if (q == NULL || pos < 0 || pos >= QUAD_DIGITS)
+    return;
+  q->a4.writeDigitAscii(pos, c);
+  quad_update(q);
 }
 
 
 void op_quad_str()
 {
-  char *s = forth_stack()->popstring();
+  Value* sv = forth_stack()->popstr();
+  char *s = sv->str;
   int addr = forth_stack()->popint();
   int widx = forth_stack()->popint();
 
-  Adafruit_AlphaNum4 a4 = Adafruit_AlphaNum4();
-  switch(widx) {
-    case 0:
-      a4.begin(addr, &Wire);
-      break;
-    case 1:
-      a4.begin(addr, &Wire1);
-      break;
-    case 2:
-      a4.begin(addr, &Wire2);
-      break;
+  QUADDISPLAY* q = quad_get(widx, addr);
+  if (q) {
+    for (int i = 0; i < QUAD_DIGITS && i < (int)strlen(s); i++)
+      q->a4.writeDigitAscii(i, s[i]);
+    quad_update(q);
   }
-  
-  for (int i = 0; i < 4 && i < (int)strlen(s); i++)
-    a4.writeDigitAscii(i, s[i]);
-  a4.writeDisplay();
+  vfree(sv);
 }
 
 
@@ -276,47 +419,75 @@ void op_quad_blank()
 }
 
 
+void op_quad_async()
+{
+  quadasync = forth_stack()->popint() != 0;
+  if (!quadasync)
+    quad_loop();
+}
+
+
+void op_quad_flush()
+{
+  quad_loop();
+}
+
+
+// custom forth words to interact with the Arduino environment
+const FBuiltin forthduino_words[] PROGMEM = {
+  { "rndm", &opRndm },
+  { "rrndm", &opRRndm },
+  { ".", &dot },
+  { "cr", &cr },
+  { "prtdict", &prtdict },
+  { "prtstk", &prtstk },
+  { "delay", &op_delay },
+  { "delayus", &op_delay_us },
+  { "now", &op_now },
+  { "pin:mode", &op_pinmode },
+  { "pin:dread", &op_digitalread },
+  { "pin:dwrite", &op_digitalwrite },
+  { "pin:aread", &op_analogread },
+  { "pin:aref", &op_analogreference },
+  { "pin:awrite", &op_analogwrite },
+  { "loop:def", &op_loopdef },
+  { "loop:forget", &op_loopforget },
+
+  { "quad:char", &op_quad_char },
+  { "quad:str", &op_quad_str },
+  { "quad:blank", &op_quad_blank },
+  { "quad:async", &op_quad_async },
+  { "quad:flush", &op_quad_flush },
+};
+
+
 void forthduino_setup()
 {
   forth_stepfunction(&step_serial);
-  looptasks = new FDict();
-
-  // define custom forth words to interact with the Arduino environment
-  forth_dict()->def("rndm", &opRndm);
-  forth_dict()->def("rrndm", &opRRndm);
-  forth_dict()->def(".", &dot);
-  forth_dict()->def("cr", &cr);
-  forth_dict()->def("prtdict", &prtdict);
-  forth_dict()->def("prtstk", &prtstk);
-  forth_dict()->def("delay", &op_delay);
-  forth_dict()->def("delayus", &op_delay_us);
-  forth_dict()->def("now", &op_now);
-  forth_dict()->def("pin:mode", &op_pinmode);
-  forth_dict()->def("pin:dread", &op_digitalread);
-  forth_dict()->def("pin:dwrite", &op_digitalwrite);
-  forth_dict()->def("pin:aread", &op_analogread);
-  forth_dict()->def("pin:aref", &op_analogreference);
-  forth_dict()->def("pin:awrite", &op_analogwrite);
-  forth_dict()->def("loop:def", &op_loopdef);
-  forth_dict()->def("loop:forget", &op_loopforget);
-
-  Serial.begin(9600);
-  Serial.println("serial started");
-
-  forth_dict()->def("quad:char", &op_quad_char);
-  forth_dict()->def("quad:str", &op_quad_str);
-  forth_dict()->def("quad:blank", &op_quad_blank);
+  forth_errorfunction(&error_serial);
+  forth_readinit(&serreader);
+  // only a handful of loop tasks are ever registered
+  looptasks = new FDict(16);
+
+  forth_dict()->builtins(forthduino_words,
+    sizeof(forthduino_words) / sizeof(forthduino_words[0]));
+
+  Serial.begin(SERIAL_BAUD);
+  out_str("serial started");
+  out_line();
 }
 
 
 void loop_check(Value* task)
 {
-    Value* seq = task->seq->head;
-    Value* rate = seq->next;
-    Value* threshold = rate->next;
+    Value* seq = task->seq->at(0);
+    Value* rate = task->seq->at(1);
+    Value* threshold = task->seq->at(2);
     double now = (double)millis();
     if (now >= threshold->fnum) {
+      unsigned long t = micros();
       forth_run(seq);
+      stat_add(STAT_TASK, micros() - t);
       threshold->fnum = now + rate->asfloat();
     }
 }
@@ -324,12 +495,33 @@ void loop_check(Value* task)
 
 void forthduino_loop()
 {
-  while (CheckSerial()) {};
+  // nothing is running between passes of the loop, so the bodies of
+  // words forgotten or redefined since the last pass can go now
+  forth_reclaim();
+
+  #ifndef _DUALCORE_
+  // with two cores, serial input is read on the other one and handed
+  // over by dual_loop
+  CheckSerial();
+  #endif
   
-  // do some default action on each loop
+  // do some default action on each loop; a task defined during the pass
+  // goes in at the head, so it first runs on the next one
+  loopwalking = true;
   Sym* task = looptasks->head;
   while (task) {
-      loop_check(task->value);
+      if (!loop_isdead(task)) {
+        prof_begin(task->word);
+        loop_check(task->value);
+        prof_end();
+      }
       task = task->next;
   }
+  loopwalking = false;
+  while (loopdead) {
+      Sym* dead = loopdead;
+      loopdead = dead->hnext;
+      delete dead;
+  }
+  quad_loop();
 }
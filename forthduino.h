@@ -14,4 +14,7 @@
 void forthduino_setup();
 void forthduino_loop();
 
+// feed one byte of console input, as if it had come from Serial
+void forthduino_input(int b);
+
 #endif
@@ -5,17 +5,38 @@
 #include "forthduino.h"
 #include "teensy41.h"
 #include "alpha.h"
+#include "pixels.h"
+#include "frame.h"
+#include "sched.h"
+#include "task.h"
+#include "ingest.h"
+#include "image.h"
+#include "prof.h"
+#include "stats.h"
+#include "out.h"
+#include "dual.h"
 
 
 void setup() {
   // initialize the forth runtime
   forth_init();
   led_setup();
+  out_init();
   forthduino_setup();
   #ifdef _TEENSY41_
   teensy41_setup();
   #endif
   alpha_init();
+  pixels_init();
+  frame_init();
+  sched_init();
+  task_init();
+  ingest_init();
+  dual_init();
+  prof_init();
+  stats_init();
+  // last, so it can tell built-in words from those defined in Forth
+  image_init();
 
   // run the bootfile.forth from the SD card, if it exists
   forth_run("'boot.forth file:run");
@@ -24,6 +45,11 @@ void setup() {
 
 void loop() {
   forthduino_loop();
+  dual_loop();
+  out_loop();
+  sched_loop();
+  task_loop();
+  frame_loop();
   #ifdef _TEENSY41_
   teensy41_loop();
   #endif
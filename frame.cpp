@@ -0,0 +1,331 @@
+//
+// Frame pipeline: frames are rendered into PIXELS back buffers while the
+// previous frame is still being sent to the LEDs. frame:begin hands out a
+// free buffer, frame:commit queues it and returns at once, and the queue
+// is sent out from the main loop whenever the hardware is not busy.
+//
+// The pipeline keeps a copy of the pixels it last put on its slot. A frame
+// that is the same as the one ahead of it is dropped at commit, and a frame
+// shown here only puts the range of pixels that changed. This assumes the
+// pipeline's slot isn't drawn on with other words in between; frame:init
+// starts over with a whole frame.
+//
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forth.h"
+#include "led.h"
+#include "frame.h"
+#include "stats.h"
+
+
+struct FRAMEPIPE {
+  int slot;
+  int len;
+  int nbuffers;
+  // buffers ready for frame:begin
+  unsigned char* free[FRAME_MAXBUFFERS];
+  int nfree;
+  // committed frames waiting to be sent, oldest first
+  unsigned char* queue[FRAME_MAXBUFFERS];
+  bool waited[FRAME_MAXBUFFERS];
+  int qfirst;
+  int qcount;
+  // stats
+  int shown;
+  int dropped;
+  int late;
+  int clean;
+  unsigned long lastshown;
+  // the pixels last put on the slot, or NULL before the first frame
+  unsigned char* onslot;
+  int put;      // pixels put for the last frame shown here
+};
+
+FRAMEPIPE frames = { 0, 0, 0, { NULL }, 0, { NULL }, { false }, 0, 0, 0, 0, 0, 0, 0, NULL, 0 };
+
+bool (*frame_busy)() = NULL;
+bool (*frame_send)(unsigned char* px, int slot, int len) = NULL;
+
+
+void frame_busyprobe(bool (*busy)())
+{
+  frame_busy = busy;
+}
+
+
+void frame_handoff(bool (*send)(unsigned char* px, int slot, int len))
+{
+  frame_send = send;
+}
+
+
+void frame_release(unsigned char* px)
+{
+  if (frames.nfree < frames.nbuffers)
+    frames.free[frames.nfree++] = px;
+  else
+    pxdelete(px);
+}
+
+
+unsigned char* frame_dequeue()
+{
+  unsigned char* px = frames.queue[frames.qfirst];
+  frames.qfirst = (frames.qfirst + 1) % FRAME_MAXBUFFERS;
+  frames.qcount--;
+  return px;
+}
+
+
+void frame_shown(unsigned long showtime)
+{
+  unsigned long done = micros();
+  stat_add(STAT_SHOW, showtime);
+  if (frames.shown > 0)
+    stat_add(STAT_FRAME, done - frames.lastshown);
+  frames.lastshown = done;
+  frames.shown++;
+}
+
+
+// keep a copy of a frame put on the slot (from pixel first up to last)
+void frame_keep(unsigned char* px, int first, int last)
+{
+  if (!frames.onslot)
+    frames.onslot = pxalloc(frames.len);
+  memcpy(frames.onslot + first*3, px + first*3, (last - first + 1)*3);
+}
+
+
+void frame_show(unsigned char* px)
+{
+  // only the pixels between the first and the last that changed
+  int first = 0;
+  int last = frames.len - 1;
+  if (frames.onslot) {
+    while (first <= last && memcmp(px + first*3, frames.onslot + first*3, 3) == 0)
+      first++;
+    while (last >= first && memcmp(px + last*3, frames.onslot + last*3, 3) == 0)
+      last--;
+  }
+  frames.put = last - first + 1;
+  if (frames.put <= 0) {
+    frames.clean++;
+    return;
+  }
+  for (int i = first; i <= last; i++) {
+    unsigned char* p = px + i*3;
+    led_put(frames.slot, i, (p[0] << 16) | (p[1] << 8) | p[2]);
+  }
+  frame_keep(px, first, last);
+  unsigned long t = micros();
+  Value* show = forth_dict()->find("led:show");
+  if (show)
+    forth_run(show);
+  frame_shown(micros() - t);
+}
+
+
+void frame_returned(unsigned char* px, int len, unsigned long showtime)
+{
+  frame_shown(showtime);
+  // frame:init may have changed the pipeline while the frame was away
+  if (len == frames.len)
+    frame_release(px);
+  else
+    pxdelete(px);
+}
+
+
+// send the oldest queued frame if the hardware is free
+void frame_pump()
+{
+  if (frames.qcount == 0)
+    return;
+  if (frame_busy && (*frame_busy)()) {
+    frames.waited[frames.qfirst] = true;
+    return;
+  }
+  unsigned char* px = frames.queue[frames.qfirst];
+  if (frame_send && !(*frame_send)(px, frames.slot, frames.len)) {
+    frames.waited[frames.qfirst] = true;
+    return;
+  }
+  if (frames.waited[frames.qfirst])
+    frames.late++;
+  frame_dequeue();
+  if (frame_send) {
+    // shown whole somewhere else; it comes back through frame_returned
+    frame_keep(px, 0, frames.len - 1);
+    return;
+  }
+  frame_show(px);
+  frame_release(px);
+}
+
+
+void frame_loop()
+{
+  frame_pump();
+}
+
+
+// slot len nbuffers --
+void op_frame_init()
+{
+  int n = forth_stack()->popint();
+  int len = forth_stack()->popint();
+  int slot = forth_stack()->popint();
+  while (frames.qcount > 0)
+    pxdelete(frame_dequeue());
+  while (frames.nfree > 0)
+    pxdelete(frames.free[--frames.nfree]);
+  if (n < 2)
+    n = 2;
+  if (n > FRAME_MAXBUFFERS)
+    n = FRAME_MAXBUFFERS;
+  if (frames.onslot)
+    frames.onslot = pxdelete(frames.onslot);
+  frames.put = 0;
+  frames.slot = slot;
+  frames.len = len > 0 ? len : 0;
+  frames.nbuffers = n;
+  for (int i = 0; i < n; i++)
+    frames.free[frames.nfree++] = pxalloc(frames.len);
+}
+
+
+// -- px
+void op_frame_begin()
+{
+  unsigned char* px;
+  if (frames.nfree > 0) {
+    px = frames.free[--frames.nfree];
+  } else if (frames.qcount > 0) {
+    // every buffer is queued: the oldest frame is superseded by this one
+    px = frame_dequeue();
+    frames.dropped++;
+  } else {
+    px = pxalloc(frames.len);
+  }
+  forth_stack()->push(valloc(px, frames.len));
+}
+
+
+// px --
+void op_frame_commit()
+{
+  Value* v = forth_stack()->pop();
+  if (v->vtype != PIXELS || v->len != frames.len || frames.nbuffers == 0) {
+    vfree(v);
+    return;
+  }
+  unsigned char* px;
+  if (!v->arefs || *v->arefs == 1) {
+    // take the buffer over from the value
+    px = v->px;
+    v->px = NULL;
+  } else {
+    px = frames.nfree > 0 ? frames.free[--frames.nfree] : pxalloc(frames.len);
+    memcpy(px, v->px, frames.len*3);
+  }
+  vfree(v);
+  // a frame the same as the one it follows changes nothing
+  unsigned char* ahead = frames.onslot;
+  if (frames.qcount > 0)
+    ahead = frames.queue[(frames.qfirst + frames.qcount - 1) % FRAME_MAXBUFFERS];
+  if (ahead && memcmp(px, ahead, frames.len*3) == 0) {
+    frame_release(px);
+    frames.clean++;
+    return;
+  }
+  if (frames.qcount == frames.nbuffers - 1) {
+    // keep the queue a frame short of the buffer count so frame:begin
+    // always has a buffer to render into
+    frame_release(frame_dequeue());
+    frames.dropped++;
+  }
+  int q = (frames.qfirst + frames.qcount) % FRAME_MAXBUFFERS;
+  frames.queue[q] = px;
+  frames.waited[q] = false;
+  frames.qcount++;
+  frame_pump();
+}
+
+
+void op_frame_pending()
+{
+  forth_stack()->push(frames.qcount);
+}
+
+void op_frame_shown()
+{
+  forth_stack()->push(frames.shown);
+}
+
+void op_frame_dropped()
+{
+  forth_stack()->push(frames.dropped);
+}
+
+void op_frame_late()
+{
+  forth_stack()->push(frames.late);
+}
+
+void op_frame_clean()
+{
+  forth_stack()->push(frames.clean);
+}
+
+void op_frame_put()
+{
+  forth_stack()->push(frames.put);
+}
+
+void op_frame_reset()
+{
+  frames.shown = 0;
+  frames.dropped = 0;
+  frames.late = 0;
+  frames.clean = 0;
+}
+
+
+// Put a whole ARRAY of packed colors (or a PIXELS array) on a slot in one
+// pass with led_put, which applies the slot's translation map (led:setmap).
+// array slot --
+void op_led_writea()
+{
+  int slot = forth_stack()->popint();
+  Value* v = forth_stack()->pop();
+  if (v->vtype == ARRAY) {
+    const int* ia = v->ia;
+    for (int i = 0; i < v->len; i++)
+      led_put(slot, i, ia[i]);
+  } else if (v->vtype == PIXELS) {
+    const unsigned char* p = v->px;
+    for (int i = 0; i < v->len; i++, p += 3)
+      led_put(slot, i, (p[0] << 16) | (p[1] << 8) | p[2]);
+  }
+  vfree(v);
+}
+
+
+void frame_init()
+{
+  forth_dict()->def("frame:init", &op_frame_init);
+  forth_dict()->def("frame:begin", &op_frame_begin);
+  forth_dict()->def("frame:commit", &op_frame_commit);
+  forth_dict()->def("frame:pending", &op_frame_pending);
+  forth_dict()->def("frame:shown", &op_frame_shown);
+  forth_dict()->def("frame:dropped", &op_frame_dropped);
+  forth_dict()->def("frame:late", &op_frame_late);
+  forth_dict()->def("frame:clean", &op_frame_clean);
+  forth_dict()->def("frame:put", &op_frame_put);
+  forth_dict()->def("frame:reset", &op_frame_reset);
+  forth_dict()->def("led:writea", &op_led_writea);
+}
@@ -0,0 +1,22 @@
+#ifndef forth_frame_h
+#define forth_frame_h
+
+// most back buffers a frame pipeline can be given with frame:init
+#define FRAME_MAXBUFFERS 4
+
+void frame_init();
+void frame_loop();
+
+// Install a probe that returns true while the LED hardware is still
+// sending the previous frame (e.g. the Octo DMA transfer). Without it,
+// frames are sent as soon as they are committed.
+void frame_busyprobe(bool (*busy)());
+
+// Install a function that takes a frame to be shown somewhere else, such as
+// on the other core, instead of it being shown here. It returns false if it
+// can't take the frame yet. The buffer is handed back with frame_returned,
+// along with the microseconds its show took.
+void frame_handoff(bool (*send)(unsigned char* px, int slot, int len));
+void frame_returned(unsigned char* px, int len, unsigned long showtime);
+
+#endif
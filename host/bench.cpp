@@ -0,0 +1,265 @@
+//
+// Interpreter micro-benchmarks. Each benchmark runs its operation for at
+// least BENCH_MINTIME, and reports the time and heap allocations per
+// operation, so changes to the hot paths can be measured before flashing.
+//
+//   ./bench            run every benchmark
+//   ./bench map        run the benchmarks whose names contain "map"
+//
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "forth.h"
+#include "out.h"
+
+#define BENCH_MINTIME 200000000LL    // ns
+#define BENCH_MINOPS 10
+
+
+void host_setup();
+
+
+// every heap allocation goes through here, so it can be counted
+long long bench_allocs = 0;
+
+void* operator new(size_t n)
+{
+  bench_allocs++;
+  void* p = malloc(n ? n : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void* operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+  free(p);
+}
+
+
+long long bench_now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+
+// the sequence bound to a defined word
+ValueStack* bench_word(const char* word)
+{
+  Value* v = forth_dict()->find(word);
+  if (!v || v->vtype != SEQ) {
+    fprintf(stderr, "bench: %s is not defined\n", word);
+    exit(1);
+  }
+  return v->seq;
+}
+
+
+void bench_report(const char* name, long long ops, long long ns, long long allocs)
+{
+  printf("%-28s %10lld ops %12.1f ns/op %10.2f allocs/op\n",
+    name, ops, (double)ns / ops, (double)allocs / ops);
+}
+
+
+// run op until enough time has passed; a few runs first warm the pools
+void bench_run(const char* name, void (*op)(void*), void* arg)
+{
+  for (int i = 0; i < BENCH_MINOPS; i++)
+    (*op)(arg);
+  long long ops = 0;
+  long long allocs = bench_allocs;
+  long long start = bench_now();
+  long long elapsed = 0;
+  while (elapsed < BENCH_MINTIME || ops < BENCH_MINOPS) {
+    for (int i = 0; i < BENCH_MINOPS; i++)
+      (*op)(arg);
+    ops += BENCH_MINOPS;
+    elapsed = bench_now() - start;
+  }
+  bench_report(name, ops, elapsed, bench_allocs - allocs);
+}
+
+
+// a run of a defined word
+void bench_seq(void* arg)
+{
+  runSequence((ValueStack*)arg);
+}
+
+
+// the kind of definitions a boot.forth library is made of
+const char* bench_lines[] = {
+  ":bench:xy (lat,long-x,y) -95 - rad sin !bench:sinlong 45 - rad sin !bench:sinlat",
+  "  1.419 @bench:sinlat * 53.725 @bench:sinlong * + -0.583 @bench:sinlat sq * +",
+  "  0.295 @bench:sinlong sq * + -56.426 @bench:sinlat * @bench:sinlong * + 17 + ;",
+  ":bench:fade (a,n-a) [ dup 0 gt [ 1 - ] swap if ] map ;",
+  ":bench:rainbow (-) 360 array identity [ 255 100 led:hsv> ] map !bench:rb ;",
+  "[ [ bench:step ] 20.0 0.0 ] 'bench:loop def",
+  ":bench:pos (i-p) dup 35 / dup 2 mod [ 34 swap - ] swap if swap 35 mod + ;",
+  "#FF0000 !bench:red #00FF00 !bench:green #0000FF !bench:blue",
+  "~~~",
+  "Comment sections between code, as in files read from the SD card.",
+  "~~~",
+  "// a comment line",
+};
+
+#define BENCH_NLINES (int)(sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+
+void bench_parse(void* arg)
+{
+  for (int i = 0; i < BENCH_NLINES; i++)
+    forth_run(bench_lines[i]);
+}
+
+
+void bench_valloc(void* arg)
+{
+  Value* v[16];
+  for (int i = 0; i < 16; i++)
+    v[i] = valloc(i);
+  for (int i = 0; i < 16; i++)
+    vfree(v[i]);
+}
+
+
+struct BENCHFIND {
+  const char** words;
+  int n;
+  int next;
+};
+
+void bench_find(void* arg)
+{
+  BENCHFIND* bf = (BENCHFIND*)arg;
+  forth_dict()->find(bf->words[bf->next]);
+  bf->next = (bf->next + 1) % bf->n;
+}
+
+
+bool bench_selected(const char* name, const char* filter)
+{
+  return !filter || strstr(name, filter) != NULL;
+}
+
+
+// a benchmark of a word defined from Forth source
+void bench_forth(const char* name, const char* word, const char* filter)
+{
+  if (bench_selected(name, filter))
+    bench_run(name, &bench_seq, bench_word(word));
+}
+
+
+int main(int argc, char** argv)
+{
+  const char* filter = argc > 1 ? argv[1] : NULL;
+  host_setup();
+  out_flush();
+
+  if (bench_selected("parse:boot-lines", filter)) {
+    // forth_run of each line, with its definitions; ops are whole passes
+    bench_run("parse:boot-lines", &bench_parse, NULL);
+  }
+
+  int sizes[] = { 256, 2208, 8192 };
+  char line[256];
+  for (int s = 0; s < 3; s++) {
+    int n = sizes[s];
+    sprintf(line, "%d array identity !a%d", n, n);
+    forth_run(line);
+    sprintf(line, ":b:add%d @a%d 3 + drop ;", n, n);
+    forth_run(line);
+    sprintf(line, ":b:chain%d @a%d 3 * 7 + 100 mod drop ;", n, n);
+    forth_run(line);
+    sprintf(line, ":b:binary%d @a%d @a%d * drop ;", n, n, n);
+    forth_run(line);
+    sprintf(line, ":b:abs%d @a%d abs drop ;", n, n);
+    forth_run(line);
+    sprintf(line, ":b:isin%d @a%d isin drop ;", n, n);
+    forth_run(line);
+    sprintf(line, ":b:map%d @a%d [ 3 * 1 + ] map drop ;", n, n);
+    forth_run(line);
+    sprintf(line, ":b:mapi%d @a%d [ 2.5 * ] map drop ;", n, n);
+    forth_run(line);
+    sprintf(line, ":b:dup%d @a%d dup 0 7 puta drop drop ;", n, n);
+    forth_run(line);
+
+    const char* kinds[] = { "add", "chain", "binary", "abs", "isin", "map", "mapi", "dup" };
+    const char* labels[] = { "array + int", "array * + mod", "array * array", "array abs", "array isin",
+      "map (kernel)", "map (interpreted)", "array dup and write" };
+    for (int k = 0; k < 8; k++) {
+      char name[64];
+      char word[32];
+      sprintf(name, "%s/%d", labels[k], n);
+      sprintf(word, "b:%s%d", kinds[k], n);
+      bench_forth(name, word, filter);
+    }
+  }
+
+  forth_run(":b:loop [ drop ] 0 100 loop ;");
+  bench_forth("loop/100", "b:loop", filter);
+  forth_run(":b:sq dup * ;");
+  forth_run(":b:calls [ b:sq drop ] 0 100 loop ;");
+  bench_forth("call/100", "b:calls", filter);
+  // the same body with the peephole pass off and on
+  forth_run("0 cmd:optimize");
+  forth_run(":b:arith0 5 [ 3 * 7 + 2 dup * mod swap drop ] 0 100 loop drop ;");
+  forth_run("1 cmd:optimize");
+  forth_run(":b:arith1 5 [ 3 * 7 + 2 dup * mod swap drop ] 0 100 loop drop ;");
+  bench_forth("arith/100", "b:arith0", filter);
+  bench_forth("arith/100 (optimized)", "b:arith1", filter);
+
+  if (bench_selected("dict:find/500", filter)) {
+    // hundreds of words, as after loading a large library
+    static char names[500][16];
+    static const char* words[500];
+    for (int i = 0; i < 500; i++) {
+      sprintf(names[i], "b:w%d", i);
+      sprintf(line, "%d '%s def", i, names[i]);
+      forth_run(line);
+      words[i] = names[i];
+    }
+    BENCHFIND bf = { words, 500, 0 };
+    bench_run("dict:find/500", &bench_find, &bf);
+  }
+
+  if (bench_selected("dict:find builtin", filter)) {
+    static const char* builtins[] = { "dup", "swap", "+", "loop", "geta",
+      "map", "over", "drop", "cr", "gt", "if", "mem:alloc" };
+    BENCHFIND bf = { builtins, 12, 0 };
+    bench_run("dict:find builtin", &bench_find, &bf);
+  }
+
+  if (bench_selected("valloc+vfree/16", filter))
+    bench_run("valloc+vfree/16", &bench_valloc, NULL);
+
+  return 0;
+}
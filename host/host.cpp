@@ -0,0 +1,58 @@
+//
+// Host build of forthduino: runs the same setup and loop as the sketch,
+// with the console on stdin and stdout.
+//
+
+#include "forth.h"
+#include "led.h"
+#include "forthduino.h"
+#include "alpha.h"
+#include "pixels.h"
+#include "frame.h"
+#include "sched.h"
+#include "task.h"
+#include "ingest.h"
+#include "image.h"
+#include "prof.h"
+#include "stats.h"
+#include "out.h"
+#include "dual.h"
+
+#include "Arduino.h"
+
+
+void host_setup()
+{
+  forth_init();
+  led_setup();
+  out_init();
+  forthduino_setup();
+  alpha_init();
+  pixels_init();
+  frame_init();
+  sched_init();
+  task_init();
+  ingest_init();
+  dual_init();
+  prof_init();
+  stats_init();
+  image_init();
+}
+
+
+#if !defined(HOST_BENCH) && !defined(HOST_TEST)
+int main()
+{
+  host_setup();
+  while (!Serial.eof) {
+    forthduino_loop();
+    dual_loop();
+    out_loop();
+    sched_loop();
+    task_loop();
+    frame_loop();
+  }
+  out_flush();
+  return 0;
+}
+#endif
@@ -0,0 +1,48 @@
+//
+// Host implementations of the stubbed hardware layers.
+//
+
+#include <unistd.h>
+#include <poll.h>
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "SD.h"
+#include "led.h"
+
+HostSerial Serial;
+TwoWire Wire, Wire1, Wire2;
+SDClass SD;
+char* __brkval = 0;
+int host_leds[HOST_LEDS];
+
+
+int HostSerial::available()
+{
+  if (eof)
+    return 0;
+  struct pollfd p = { 0, POLLIN, 0 };
+  return poll(&p, 1, 0) > 0 ? 1 : 0;
+}
+
+
+int HostSerial::read()
+{
+  unsigned char c;
+  if (::read(0, &c, 1) == 1)
+    return c;
+  eof = true;
+  return -1;
+}
+
+
+void led_setup()
+{
+}
+
+
+void led_put(int slot, int p, int c)
+{
+  if (p >= 0 && p < HOST_LEDS)
+    host_leds[p] = c;
+}
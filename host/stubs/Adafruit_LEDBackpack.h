@@ -0,0 +1,16 @@
+#ifndef host_ledbackpack_h
+#define host_ledbackpack_h
+
+#include "Wire.h"
+
+class Adafruit_AlphaNum4 {
+public:
+  uint16_t displaybuffer[8];
+  bool begin(uint8_t, TwoWire* = &Wire) { return true; }
+  void writeDigitAscii(uint8_t n, uint8_t a, bool dot = false) { displaybuffer[n] = a | (dot ? 0x4000 : 0); }
+  void writeDigitRaw(uint8_t n, uint16_t b) { displaybuffer[n] = b; }
+  void writeDisplay() {}
+  void clear() {}
+};
+
+#endif
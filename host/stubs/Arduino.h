@@ -0,0 +1,80 @@
+//
+// Host stand-ins for the parts of the Arduino core used by forthduino.
+//
+
+#ifndef host_arduino_h
+#define host_arduino_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+
+// the Arduino core version, which also selects the freeMemory() variant
+#define ARDUINO 10813
+
+#define PI 3.1415926535897932384626433832795
+#define INPUT 0
+#define OUTPUT 1
+#define HIGH 1
+#define LOW 0
+
+// constant tables stay where they are
+#define PROGMEM
+
+template<class T> T sq(T a) { return a*a; }
+template<class T, class U, class V> T constrain(T a, U b, V c) { return a < b ? b : (a > c ? c : a); }
+using std::abs;
+using std::max;
+using std::min;
+
+inline unsigned long micros()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (unsigned long)(t.tv_sec*1000000ull + t.tv_nsec/1000);
+}
+
+inline unsigned long millis() { return micros()/1000; }
+inline void delay(unsigned long ms) { unsigned long s = millis(); while (millis() - s < ms) ; }
+inline void delayMicroseconds(unsigned int us) { unsigned long s = micros(); while (micros() - s < us) ; }
+inline long random(long m) { return m ? rand() % m : 0; }
+inline long random(long a, long b) { return a + random(b - a); }
+inline void pinMode(int, int) {}
+inline int digitalRead(int) { return 0; }
+inline void digitalWrite(int, int) {}
+inline int analogRead(int) { return 0; }
+inline void analogWrite(int, int) {}
+inline void analogReference(int) {}
+
+extern char* __brkval;
+
+// console on stdin / stdout
+class HostSerial {
+public:
+  bool eof = false;   // stdin has been closed
+
+  void begin(long) {}
+  int available();
+  int read();
+  int availableForWrite() { return 1024; }
+  size_t write(const unsigned char* b, size_t n) { return fwrite(b, 1, n, stdout); }
+  size_t write(unsigned char c) { fputc(c, stdout); return 1; }
+  void print(const char* s) { fputs(s, stdout); }
+  void print(char c) { fputc(c, stdout); }
+  void print(int v) { printf("%d", v); }
+  void print(unsigned int v) { printf("%u", v); }
+  void print(long v) { printf("%ld", v); }
+  void print(unsigned long v) { printf("%lu", v); }
+  void print(double v) { printf("%.2f", v); }
+  void println() { fputc('\n', stdout); }
+  template<class T> void println(T v) { print(v); println(); }
+  void flush() { fflush(stdout); }
+};
+
+extern HostSerial Serial;
+
+#endif
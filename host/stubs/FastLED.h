@@ -0,0 +1,2 @@
+// FastLED is not needed on the host
+#include "Arduino.h"
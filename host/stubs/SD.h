@@ -0,0 +1,32 @@
+#ifndef host_sd_h
+#define host_sd_h
+
+// SD card files map to files in the current directory
+
+#include "Arduino.h"
+
+#define FILE_READ 0
+#define FILE_WRITE 1
+#define BUILTIN_SDCARD 254
+
+class File {
+public:
+  FILE* fp;
+  File() : fp(NULL) {}
+  File(FILE* f) : fp(f) {}
+  operator bool() const { return fp != NULL; }
+  int read(void* b, size_t n) { return fp ? (int)fread(b, 1, n, fp) : -1; }
+  size_t write(const void* b, size_t n) { return fp ? fwrite(b, 1, n, fp) : 0; }
+  void close() { if (fp) fclose(fp); fp = NULL; }
+};
+
+class SDClass {
+public:
+  bool begin(int) { return true; }
+  File open(const char* n, int mode = FILE_READ) { return File(fopen(n, mode == FILE_WRITE ? "ab" : "rb")); }
+  bool remove(const char* n) { return ::remove(n) == 0; }
+};
+
+extern SDClass SD;
+
+#endif
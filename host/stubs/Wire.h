@@ -0,0 +1,18 @@
+#ifndef host_wire_h
+#define host_wire_h
+
+#include "Arduino.h"
+
+class TwoWire {
+public:
+  void begin() {}
+  void setClock(long) {}
+  void beginTransmission(int) {}
+  size_t write(uint8_t) { return 1; }
+  size_t write(const uint8_t*, size_t n) { return n; }
+  int endTransmission(bool = true) { return 0; }
+};
+
+extern TwoWire Wire, Wire1, Wire2;
+
+#endif
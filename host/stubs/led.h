@@ -0,0 +1,12 @@
+#ifndef host_led_h
+#define host_led_h
+
+// the LED layer keeps a plain buffer of colors on the host
+#define HOST_LEDS 8192
+
+void led_setup();
+void led_put(int slot, int p, int c);
+
+extern int host_leds[HOST_LEDS];
+
+#endif
@@ -0,0 +1,89 @@
+//
+// Host tests: each one drives the interpreter and the main loop the way the
+// sketch does, and checks the result. The run prints one line per failed
+// check and exits non-zero if there were any.
+//
+//   ./test
+//
+
+#include <stdio.h>
+
+#include "forth.h"
+#include "led.h"
+#include "forthduino.h"
+#include "frame.h"
+#include "out.h"
+
+
+void host_setup();
+
+int test_failed = 0;
+
+
+void test_check(const char* name, bool ok)
+{
+  if (!ok) {
+    printf("FAIL %s\n", name);
+    test_failed++;
+  }
+}
+
+
+// the top of the stack as an int, popped
+int test_int(const char* line)
+{
+  forth_run(line);
+  return forth_stack()->popint();
+}
+
+
+// led:show is a native word of the LED layer, which the host doesn't have
+int test_shows = 0;
+
+void test_ledshow()
+{
+  test_shows++;
+}
+
+
+// a committed frame is put on its slot and shown with led:show
+void test_frameshow()
+{
+  forth_dict()->def("led:show", &test_ledshow);
+  forth_run("0 8 2 frame:init frame:reset");
+  forth_run("frame:begin 255 px:add frame:commit");
+  frame_loop();
+  test_check("frame: led:show runs", test_shows == 1);
+  test_check("frame: shown", test_int("frame:shown") == 1);
+  test_check("frame: pixels put", host_leds[0] == 255 && host_leds[7] == 255);
+  forth_dict()->forget("led:show");
+}
+
+
+extern FDict* looptasks;
+
+// a loop task can forget itself, and the task that would run after it
+void test_loopforget()
+{
+  forth_run("0 !tl:n 0 !tl:c");
+  forth_run("[ [ @tl:c 1 + !tl:c 'tl:c loop:forget ] 0.0 0.0 ] 'tl:c loop:def");
+  forth_run("[ [ @tl:n 1 + !tl:n ] 0.0 0.0 ] 'tl:b loop:def");
+  forth_run("[ [ 'tl:a loop:forget 'tl:b loop:forget ] 0.0 0.0 ] 'tl:a loop:def");
+  for (int i = 0; i < 3; i++)
+    forthduino_loop();
+  test_check("loop: forgotten task not run", test_int("@tl:n") == 0);
+  test_check("loop: self forget runs once", test_int("@tl:c") == 1);
+  test_check("loop: tasks gone", looptasks->head == NULL);
+}
+
+
+int main()
+{
+  host_setup();
+  out_flush();
+  test_frameshow();
+  test_loopforget();
+  out_flush();
+  printf("%s\n", test_failed ? "tests failed" : "tests passed");
+  return test_failed ? 1 : 0;
+}
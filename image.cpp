@@ -0,0 +1,504 @@
+//
+// Dictionary images: the words defined by a Forth source file are saved to
+// SD as a compact binary image, and loaded back with one sequential read
+// instead of tokenizing and parsing the source again. References to other
+// words are saved by name and looked up when the image is loaded.
+//
+// An image records a hash of the source it was made from. dict:cache loads
+// the image when the hash still matches the source file, and otherwise runs
+// the source and saves a new image.
+//
+// Image layout (little endian):
+//   "FDI1", source hash (4 bytes), number of words (4 bytes)
+//   then for each word, oldest first: name, value
+//
+// A name or string is a 2-byte length and its bytes. A value is a type byte
+// followed by the value's content: see image_putvalue().
+//
+
+#include <SD.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forth.h"
+#include "image.h"
+
+
+// types of saved values, beyond the VALUETYPE ones
+#define IMG_CALL 16       // call of a defined word, by name
+#define IMG_CALLSEQ 17    // call of a sequence no word refers to any more
+#define IMG_SLOTGET 18    // @word, by name
+#define IMG_SLOTPUT 19    // !word, by name
+#define IMG_LITOP 20      // int literal and binary word fused, see op_litop
+
+#define IMG_BUFSIZE 512
+#define IMG_MAXNAME 256
+
+// the newest word defined before any Forth code ran
+Sym* image_builtins = NULL;
+
+
+struct IMGFILE {
+  File f;
+  unsigned char buf[IMG_BUFSIZE];
+  int len;
+  int pos;
+  bool failed;
+};
+
+
+void image_flush(IMGFILE* img)
+{
+  if (img->len > 0 && (int)img->f.write(img->buf, img->len) != img->len)
+    img->failed = true;
+  img->len = 0;
+}
+
+
+void image_put(IMGFILE* img, const void* data, int n)
+{
+  const unsigned char* p = (const unsigned char*)data;
+  while (n > 0) {
+    if (img->len == IMG_BUFSIZE)
+      image_flush(img);
+    int chunk = IMG_BUFSIZE - img->len < n ? IMG_BUFSIZE - img->len : n;
+    memcpy(img->buf + img->len, p, chunk);
+    img->len += chunk;
+    p += chunk;
+    n -= chunk;
+  }
+}
+
+
+void image_puttype(IMGFILE* img, int t)
+{
+  unsigned char b = t;
+  image_put(img, &b, 1);
+}
+
+
+void image_putint(IMGFILE* img, int n)
+{
+  unsigned char b[4] = { (unsigned char)n, (unsigned char)(n >> 8), (unsigned char)(n >> 16), (unsigned char)(n >> 24) };
+  image_put(img, b, 4);
+}
+
+
+void image_putstr(IMGFILE* img, const char* s)
+{
+  int n = strlen(s);
+  unsigned char b[2] = { (unsigned char)n, (unsigned char)(n >> 8) };
+  image_put(img, b, 2);
+  image_put(img, s, n);
+}
+
+
+void image_get(IMGFILE* img, void* data, int n)
+{
+  unsigned char* p = (unsigned char*)data;
+  while (n > 0 && !img->failed) {
+    if (img->pos == img->len) {
+      img->len = img->f.read(img->buf, IMG_BUFSIZE);
+      img->pos = 0;
+      if (img->len <= 0) {
+        img->len = 0;
+        img->failed = true;
+        break;
+      }
+    }
+    int chunk = img->len - img->pos < n ? img->len - img->pos : n;
+    memcpy(p, img->buf + img->pos, chunk);
+    img->pos += chunk;
+    p += chunk;
+    n -= chunk;
+  }
+}
+
+
+int image_getint(IMGFILE* img)
+{
+  unsigned char b[4] = { 0, 0, 0, 0 };
+  image_get(img, b, 4);
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((unsigned int)b[3] << 24);
+}
+
+
+// reads a name or string into s, which holds IMG_MAXNAME bytes
+void image_getstr(IMGFILE* img, char* s)
+{
+  unsigned char b[2] = { 0, 0 };
+  image_get(img, b, 2);
+  int n = b[0] | (b[1] << 8);
+  if (n >= IMG_MAXNAME) {
+    img->failed = true;
+    n = 0;
+  }
+  image_get(img, s, n);
+  s[n] = 0;
+}
+
+
+// the word a value is bound to, or NULL
+Sym* image_symfor(ValueStack* seq, void(*func)())
+{
+  for (Sym* sym = forth_dict()->head; sym; sym = sym->next) {
+    Value* v = sym->value;
+    if (seq && v->vtype == SEQ && v->seq == seq)
+      return sym;
+    if (!seq && v->vtype == FUNC && v->func == func && !v->seq)
+      return sym;
+  }
+  return NULL;
+}
+
+
+// the name a built-in function is saved by, or NULL
+const char* image_funcname(void(*func)())
+{
+  Sym* sym = image_symfor(NULL, func);
+  if (sym)
+    return sym->word;
+  return forth_dict()->builtinname(func);
+}
+
+
+void image_putseq(IMGFILE* img, ValueStack* seq);
+
+
+void image_putvalue(IMGFILE* img, Value* v)
+{
+  switch (v->vtype) {
+    case INT:
+      image_puttype(img, INT);
+      image_putint(img, v->inum);
+      break;
+    case FLOAT:
+      image_puttype(img, FLOAT);
+      image_put(img, &v->fnum, sizeof(double));
+      break;
+    case STR:
+      image_puttype(img, STR);
+      image_putstr(img, v->str);
+      break;
+    case FUNC:
+      if (v->func == &op_litop) {
+        const char* name = image_funcname(v->mword->func);
+        if (!name) {
+          img->failed = true;
+          return;
+        }
+        image_puttype(img, IMG_LITOP);
+        image_putint(img, v->litarg);
+        image_putstr(img, name);
+      } else if (v->func == &op_slotget || v->func == &op_slotput) {
+        image_puttype(img, v->func == &op_slotget ? IMG_SLOTGET : IMG_SLOTPUT);
+        image_putstr(img, v->slot->word);
+      } else if (v->seq) {
+        // a call of a defined word
+        Sym* sym = image_symfor(v->seq, NULL);
+        if (sym) {
+          image_puttype(img, IMG_CALL);
+          image_putstr(img, sym->word);
+        } else {
+          image_puttype(img, IMG_CALLSEQ);
+          image_putseq(img, v->seq);
+        }
+      } else {
+        // a built-in word, saved by name
+        const char* name = image_funcname(v->func);
+        if (!name) {
+          img->failed = true;
+          return;
+        }
+        image_puttype(img, FUNC);
+        image_putstr(img, name);
+      }
+      break;
+    case SEQ:
+      image_puttype(img, SEQ);
+      image_putseq(img, v->seq);
+      break;
+    case ARRAY:
+      image_puttype(img, ARRAY);
+      image_putint(img, v->len);
+      for (int i = 0; i < v->len; i++)
+        image_putint(img, v->ia[i]);
+      break;
+    case SYM:
+      image_puttype(img, SYM);
+      image_putstr(img, v->sym->word);
+      break;
+    case PIXELS:
+      image_puttype(img, PIXELS);
+      image_putint(img, v->len);
+      image_put(img, v->px, v->len*3);
+      break;
+    default:
+      image_puttype(img, FREE);
+      break;
+  }
+}
+
+
+void image_putseq(IMGFILE* img, ValueStack* seq)
+{
+  image_putint(img, seq->size());
+  for (int i = 0; i < seq->size(); i++)
+    image_putvalue(img, seq->at(i));
+}
+
+
+ValueStack* image_getseq(IMGFILE* img);
+
+
+// a value read back from an image, or NULL if it can't be rebuilt here
+Value* image_getvalue(IMGFILE* img)
+{
+  char name[IMG_MAXNAME];
+  unsigned char t = 0;
+  image_get(img, &t, 1);
+  if (img->failed)
+    return NULL;
+  switch (t) {
+    case INT:
+      return valloc(image_getint(img));
+    case FLOAT: {
+      double d = 0;
+      image_get(img, &d, sizeof(double));
+      return valloc(d);
+    }
+    case STR:
+      image_getstr(img, name);
+      return valloc(name);
+    case FUNC: {
+      image_getstr(img, name);
+      Value* fv = forth_dict()->find(name);
+      if (!fv || fv->vtype != FUNC)
+        return NULL;
+      return valloc(fv);
+    }
+    case IMG_CALL: {
+      image_getstr(img, name);
+      Value* dv = forth_dict()->find(name);
+      if (!dv || dv->vtype != SEQ)
+        return NULL;
+      Value* call = valloc(&op_call);
+      call->seq = dv->seq;
+      seq_retain(call->seq);
+      return call;
+    }
+    case IMG_LITOP: {
+      int lit = image_getint(img);
+      image_getstr(img, name);
+      Value* fv = forth_dict()->find(name);
+      const MapWord* mw = fv && fv->vtype == FUNC ? forth_mapword(fv->func) : NULL;
+      if (!mw)
+        return NULL;
+      Value* lv = valloc(&op_litop);
+      lv->mword = mw;
+      lv->litarg = lit;
+      return lv;
+    }
+    case IMG_SLOTGET:
+    case IMG_SLOTPUT: {
+      image_getstr(img, name);
+      Value* sv = valloc(t == IMG_SLOTGET ? &op_slotget : &op_slotput);
+      sv->slot = forth_dict()->slot(name);
+      return sv;
+    }
+    case IMG_CALLSEQ:
+    case SEQ: {
+      ValueStack* seq = image_getseq(img);
+      if (!seq)
+        return NULL;
+      if (t == SEQ)
+        return valloc(seq);
+      // nothing else owns the called sequence, so the call takes it over
+      Value* call = valloc(&op_call);
+      call->seq = region_clone(seq);
+      seq->deleteSequences();
+      delete seq;
+      return call;
+    }
+    case ARRAY: {
+      int len = image_getint(img);
+      if (len < 0 || img->failed)
+        return NULL;
+      int* ia = iaalloc(len);
+      for (int i = 0; i < len; i++)
+        ia[i] = image_getint(img);
+      return valloc(ia, len);
+    }
+    case SYM: {
+      image_getstr(img, name);
+      Sym* sym = forth_dict()->findsym(name);
+      return sym ? valloc(sym) : NULL;
+    }
+    case PIXELS: {
+      int len = image_getint(img);
+      if (len < 0 || img->failed)
+        return NULL;
+      unsigned char* px = pxalloc(len);
+      image_get(img, px, len*3);
+      return valloc(px, len);
+    }
+  }
+  return NULL;
+}
+
+
+ValueStack* image_getseq(IMGFILE* img)
+{
+  int n = image_getint(img);
+  if (img->failed || n < 0)
+    return NULL;
+  ValueStack* seq = new ValueStack();
+  for (int i = 0; i < n; i++) {
+    Value* v = image_getvalue(img);
+    if (!v) {
+      seq->deleteSequences();
+      delete seq;
+      return NULL;
+    }
+    seq->pushTail(v);
+  }
+  return seq;
+}
+
+
+// FNV-1a hash of a file's content, or 0 if it can't be read
+unsigned int image_hashfile(const char* fname)
+{
+  File f = SD.open(fname);
+  if (!f)
+    return 0;
+  unsigned int h = 2166136261u;
+  unsigned char buf[IMG_BUFSIZE];
+  int n;
+  while ((n = f.read(buf, IMG_BUFSIZE)) > 0)
+    for (int i = 0; i < n; i++)
+      h = (h ^ buf[i]) * 16777619u;
+  f.close();
+  return h;
+}
+
+
+// save the words defined since stop, oldest first
+bool image_save(const char* fname, unsigned int hash, Sym* stop)
+{
+  int n = 0;
+  for (Sym* sym = forth_dict()->head; sym && sym != stop; sym = sym->next)
+    n++;
+  Sym** syms = new Sym*[n > 0 ? n : 1];
+  int i = n;
+  for (Sym* sym = forth_dict()->head; sym && sym != stop; sym = sym->next)
+    syms[--i] = sym;
+
+  SD.remove(fname);
+  IMGFILE* img = new IMGFILE;
+  img->f = SD.open(fname, FILE_WRITE);
+  img->len = 0;
+  img->pos = 0;
+  img->failed = !img->f;
+  if (!img->failed) {
+    image_put(img, "FDI1", 4);
+    image_putint(img, hash);
+    image_putint(img, n);
+    for (i = 0; i < n; i++) {
+      image_putstr(img, syms[i]->word);
+      image_putvalue(img, syms[i]->value);
+    }
+    image_flush(img);
+    img->f.close();
+  }
+  bool ok = !img->failed;
+  if (!ok)
+    SD.remove(fname);
+  delete img;
+  delete[] syms;
+  return ok;
+}
+
+
+// load an image made from a source with the given hash (0 for any)
+bool image_load(const char* fname, unsigned int hash)
+{
+  IMGFILE* img = new IMGFILE;
+  img->f = SD.open(fname);
+  img->len = 0;
+  img->pos = 0;
+  img->failed = !img->f;
+  char magic[4];
+  image_get(img, magic, 4);
+  unsigned int h = image_getint(img);
+  int n = image_getint(img);
+  if (memcmp(magic, "FDI1", 4) != 0 || (hash != 0 && h != hash))
+    img->failed = true;
+  char name[IMG_MAXNAME];
+  for (int i = 0; i < n && !img->failed; i++) {
+    image_getstr(img, name);
+    Value* v = image_getvalue(img);
+    if (!v) {
+      img->failed = true;
+      break;
+    }
+    forth_dict()->forget(name);
+    forth_dict()->bind(name, v);
+  }
+  if (img->f)
+    img->f.close();
+  bool ok = !img->failed;
+  delete img;
+  return ok;
+}
+
+
+// 'image --
+void op_dict_save()
+{
+  char* fname = forth_stack()->popstring();
+  forth_stack()->push(image_save(fname, 0, image_builtins) ? 1 : 0);
+  strdelete(fname);
+}
+
+
+// 'image -- ok
+void op_dict_load()
+{
+  char* fname = forth_stack()->popstring();
+  forth_stack()->push(image_load(fname, 0) ? 1 : 0);
+  strdelete(fname);
+}
+
+
+// 'source 'image --
+void op_dict_cache()
+{
+  char* iname = forth_stack()->popstring();
+  char* sname = forth_stack()->popstring();
+  unsigned int hash = image_hashfile(sname);
+  if (hash == 0 || !image_load(iname, hash)) {
+    // stale or missing image: run the source, which (re)defines every
+    // word a partial load may have left, and save what it defined
+    Sym* before = forth_dict()->head;
+    Value* run = forth_dict()->find("file:run");
+    if (run) {
+      forth_stack()->push(sname);
+      runValue(run);
+    }
+    if (hash != 0)
+      image_save(iname, hash, before);
+  }
+  strdelete(sname);
+  strdelete(iname);
+}
+
+
+void image_init()
+{
+  forth_dict()->def("dict:save", &op_dict_save);
+  forth_dict()->def("dict:load", &op_dict_load);
+  forth_dict()->def("dict:cache", &op_dict_cache);
+  // everything defined so far is built in, and never saved in an image
+  image_builtins = forth_dict()->head;
+}
@@ -0,0 +1,6 @@
+#ifndef forth_image_h
+#define forth_image_h
+
+void image_init();
+
+#endif
@@ -0,0 +1,166 @@
+//
+// Binary frame ingest: pixel data in a packet is written directly into an
+// LED slot or an ARRAY, with no tokenizing or Value allocation per pixel.
+// The UDP receive loop asks ingest_binary() for the port's mode, and hands
+// binary packets to ingest_packet() instead of forth_run().
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "forth.h"
+#include "led.h"
+#include "ingest.h"
+
+
+struct INGESTPORT {
+  int port;     // 0 when the entry is unused
+  bool binary;
+};
+
+INGESTPORT ingestports[INGEST_MAXPORTS];
+
+// stats
+int ingest_packets = 0;
+int ingest_errors = 0;
+int ingest_pixels = 0;
+
+
+bool ingest_binary(int port)
+{
+  for (int i = 0; i < INGEST_MAXPORTS; i++)
+    if (ingestports[i].port == port)
+      return ingestports[i].binary;
+  return false;
+}
+
+
+const int ingest_bpp[] = { 3, 2, 1 };
+
+
+// one pixel of the given format, as a packed int color
+int ingest_color(int format, const unsigned char* p)
+{
+  switch (format) {
+    case INGEST_RGB:
+      return (p[0] << 16) | (p[1] << 8) | p[2];
+    case INGEST_RGB565: {
+      int c = p[0] | (p[1] << 8);
+      int r = (c >> 11) & 0x1F;
+      int g = (c >> 5) & 0x3F;
+      int b = c & 0x1F;
+      return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+    }
+    case INGEST_GRAY:
+      return (p[0] << 16) | (p[0] << 8) | p[0];
+  }
+  return 0;
+}
+
+
+int ingest_packet(const unsigned char* buf, int len)
+{
+  if (len < INGEST_HEADER || buf[0] != INGEST_MAGIC || buf[1] > INGEST_GRAY) {
+    ingest_errors++;
+    return -1;
+  }
+  int format = buf[1];
+  int slot = buf[2];
+  int namelen = buf[3];
+  int offset = buf[4] | (buf[5] << 8);
+  int count = buf[6] | (buf[7] << 8);
+  const unsigned char* data = buf + INGEST_HEADER + namelen;
+  int bpp = ingest_bpp[format];
+  if (INGEST_HEADER + namelen + count*bpp > len) {
+    ingest_errors++;
+    return -1;
+  }
+
+  if (slot == INGEST_TOARRAY) {
+    char name[256];
+    memcpy(name, buf + INGEST_HEADER, namelen);
+    name[namelen] = 0;
+    Value* v = forth_dict()->find(name);
+    if (!v || v->vtype != ARRAY) {
+      ingest_errors++;
+      return -1;
+    }
+    if (offset >= v->len)
+      count = 0;
+    else if (offset + count > v->len)
+      count = v->len - offset;
+    int* ia = iamutable(v) + offset;
+    for (int i = 0; i < count; i++)
+      ia[i] = ingest_color(format, data + i*bpp);
+  } else {
+    for (int i = 0; i < count; i++)
+      led_put(slot, offset + i, ingest_color(format, data + i*bpp));
+  }
+  ingest_packets++;
+  ingest_pixels += count;
+  return count;
+}
+
+
+// port binary --
+void op_udp_mode()
+{
+  bool binary = forth_stack()->popint() != 0;
+  int port = forth_stack()->popint();
+  int free = -1;
+  for (int i = 0; i < INGEST_MAXPORTS; i++) {
+    if (ingestports[i].port == port) {
+      ingestports[i].binary = binary;
+      return;
+    }
+    if (free < 0 && ingestports[i].port == 0)
+      free = i;
+  }
+  if (free >= 0) {
+    ingestports[free].port = port;
+    ingestports[free].binary = binary;
+  }
+}
+
+
+// decode a packet given as a string of hex digits, for testing over serial
+// 'hex --
+void op_ingest_hex()
+{
+  char* s = forth_stack()->popstring();
+  int n = strlen(s) / 2;
+  unsigned char* buf = new unsigned char[n > 0 ? n : 1];
+  for (int i = 0; i < n; i++) {
+    char hex[3] = { s[i*2], s[i*2+1], 0 };
+    buf[i] = (unsigned char)strtol(hex, NULL, 16);
+  }
+  forth_stack()->push(ingest_packet(buf, n));
+  delete[] buf;
+  strdelete(s);
+}
+
+
+void op_ingest_packets()
+{
+  forth_stack()->push(ingest_packets);
+}
+
+void op_ingest_errors()
+{
+  forth_stack()->push(ingest_errors);
+}
+
+void op_ingest_pixels()
+{
+  forth_stack()->push(ingest_pixels);
+}
+
+
+void ingest_init()
+{
+  forth_dict()->def("udp:mode", &op_udp_mode);
+  forth_dict()->def("ingest:hex", &op_ingest_hex);
+  forth_dict()->def("ingest:packets", &op_ingest_packets);
+  forth_dict()->def("ingest:errors", &op_ingest_errors);
+  forth_dict()->def("ingest:pixels", &op_ingest_pixels);
+}
@@ -0,0 +1,31 @@
+#ifndef forth_ingest_h
+#define forth_ingest_h
+
+//
+// Binary frame packets, as an alternative to sending pixels as text:
+//
+//   byte 0     INGEST_MAGIC
+//   byte 1     pixel format, one of INGEST_FORMAT
+//   byte 2     LED slot, or INGEST_TOARRAY to write into a named ARRAY
+//   byte 3     length of the array name (INGEST_TOARRAY only, else 0)
+//   bytes 4-5  offset of the first pixel, little endian
+//   bytes 6-7  number of pixels, little endian
+//   the array name, if any, and then the pixel data
+//
+#define INGEST_MAGIC 0xFB
+#define INGEST_HEADER 8
+#define INGEST_TOARRAY 0xFF
+#define INGEST_MAXPORTS 4
+
+enum INGEST_FORMAT { INGEST_RGB, INGEST_RGB565, INGEST_GRAY };
+
+void ingest_init();
+
+// true if packets received on this UDP port are binary frames
+bool ingest_binary(int port);
+
+// decode one packet straight from the receive buffer; returns the number
+// of pixels written, or -1 if the packet is malformed
+int ingest_packet(const unsigned char* buf, int len);
+
+#endif
@@ -0,0 +1,230 @@
+//
+// Output sink: everything the interpreter prints goes into a ring buffer,
+// and out_loop() passes it on to Serial in bulk, only as much as Serial can
+// take without blocking. When the buffer is full, a print waits for part
+// of it to be written, so output is never lost. Numbers are formatted here
+// instead of with sprintf.
+//
+
+#include <Arduino.h>
+#include <math.h>
+#include <string.h>
+
+#include "forth.h"
+#include "out.h"
+
+
+char outbuf[OUT_BUFSIZE];
+unsigned int outhead = 0;   // free running: bytes added
+unsigned int outtail = 0;   // free running: bytes sent
+int outstalls = 0;
+
+char* outcap = NULL;
+int outcapsize = 0;
+int outcaplen = 0;
+
+
+// write up to max bytes of the buffer to Serial, which may block
+void out_send(unsigned int max)
+{
+  while (max > 0 && outhead != outtail) {
+    unsigned int at = outtail & (OUT_BUFSIZE - 1);
+    unsigned int n = outhead - outtail;
+    if (n > OUT_BUFSIZE - at)
+      n = OUT_BUFSIZE - at;
+    if (n > max)
+      n = max;
+    Serial.write((const uint8_t*)&outbuf[at], n);
+    outtail += n;
+    max -= n;
+  }
+}
+
+
+void out_loop()
+{
+  int room = Serial.availableForWrite();
+  if (room > 0)
+    out_send(room);
+}
+
+
+void out_flush()
+{
+  out_send(OUT_BUFSIZE);
+  Serial.flush();
+}
+
+
+void out_char(char c)
+{
+  if (outcap) {
+    if (outcaplen < outcapsize - 1) {
+      outcap[outcaplen++] = c;
+      outcap[outcaplen] = 0;
+    }
+    return;
+  }
+  if (outhead - outtail == OUT_BUFSIZE) {
+    outstalls++;
+    out_send(OUT_BUFSIZE / 4);
+  }
+  outbuf[outhead++ & (OUT_BUFSIZE - 1)] = c;
+}
+
+
+void out_str(const char* s)
+{
+  while (*s)
+    out_char(*s++);
+}
+
+
+void out_int(long n)
+{
+  char buf[OUT_NUMSIZE];
+  fmt_int(buf, n);
+  out_str(buf);
+}
+
+
+void out_unsigned(unsigned long n)
+{
+  char buf[OUT_NUMSIZE];
+  fmt_unsigned(buf, n);
+  out_str(buf);
+}
+
+
+void out_float(double d, int places)
+{
+  char buf[OUT_NUMSIZE];
+  fmt_float(buf, d, places);
+  out_str(buf);
+}
+
+
+// the same line ending as Serial.println
+void out_line()
+{
+  out_char('\r');
+  out_char('\n');
+}
+
+
+void out_capture(char* buf, int size)
+{
+  outcap = buf;
+  outcapsize = size;
+  outcaplen = 0;
+  if (buf && size > 0)
+    buf[0] = 0;
+}
+
+
+int fmt_ull(char* buf, unsigned long long n)
+{
+  char digits[24];
+  int nd = 0;
+  do {
+    digits[nd++] = '0' + (int)(n % 10);
+    n /= 10;
+  } while (n);
+  for (int i = 0; i < nd; i++)
+    buf[i] = digits[nd - 1 - i];
+  buf[nd] = 0;
+  return nd;
+}
+
+
+int fmt_unsigned(char* buf, unsigned long n)
+{
+  return fmt_ull(buf, n);
+}
+
+
+int fmt_int(char* buf, long n)
+{
+  if (n < 0) {
+    buf[0] = '-';
+    return 1 + fmt_ull(buf + 1, 0ULL - (unsigned long long)n);
+  }
+  return fmt_ull(buf, n);
+}
+
+
+// fixed point with the given number of decimal places (at most 9),
+// rounded to nearest
+int fmt_float(char* buf, double d, int places)
+{
+  if (isnan(d)) {
+    strcpy(buf, "nan");
+    return 3;
+  }
+  int n = 0;
+  if (d < 0) {
+    buf[n++] = '-';
+    d = -d;
+  }
+  if (isinf(d) || d >= 1.8e19) {
+    strcpy(buf + n, isinf(d) ? "inf" : "ovf");
+    return n + 3;
+  }
+  if (places < 0)
+    places = 0;
+  if (places > 9)
+    places = 9;
+  double rounding = 0.5;
+  for (int i = 0; i < places; i++)
+    rounding /= 10.0;
+  d += rounding;
+  unsigned long long ip = (unsigned long long)d;
+  double frac = d - (double)ip;
+  n += fmt_ull(buf + n, ip);
+  if (places > 0) {
+    buf[n++] = '.';
+    for (int i = 0; i < places; i++) {
+      frac *= 10.0;
+      int digit = (int)frac;
+      buf[n++] = '0' + digit;
+      frac -= digit;
+    }
+  }
+  buf[n] = 0;
+  return n;
+}
+
+
+void op_serial_baud()
+{
+  int baud = forth_stack()->popint();
+  out_flush();
+  Serial.begin(baud);
+}
+
+
+void op_out_flush()
+{
+  out_flush();
+}
+
+
+void op_out_pending()
+{
+  forth_stack()->push((int)(outhead - outtail));
+}
+
+
+void op_out_stalls()
+{
+  forth_stack()->push(outstalls);
+}
+
+
+void out_init()
+{
+  forth_dict()->def("serial:baud", &op_serial_baud);
+  forth_dict()->def("out:flush", &op_out_flush);
+  forth_dict()->def("out:pending", &op_out_pending);
+  forth_dict()->def("out:stalls", &op_out_stalls);
+}
@@ -0,0 +1,41 @@
+#ifndef forth_out_h
+#define forth_out_h
+
+// bytes of output held for the serial port, a power of two
+#define OUT_BUFSIZE 2048
+
+// rate the serial port starts at; serial:baud changes it
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD 9600
+#endif
+
+// room a formatted number needs, including the terminating NUL
+#define OUT_NUMSIZE 32
+
+void out_init();
+
+// pass buffered output on to Serial, as much as it takes without blocking
+void out_loop();
+
+// wait until all buffered output has been written
+void out_flush();
+
+void out_char(char c);
+void out_str(const char* s);
+void out_int(long n);
+void out_unsigned(unsigned long n);
+void out_float(double d, int places);
+void out_line();
+
+// while a capture buffer is set, output is added to it (NUL terminated,
+// up to size - 1 characters) instead of going to Serial, e.g. to build
+// a UDP reply; pass NULL to go back to Serial
+void out_capture(char* buf, int size);
+
+// write a number into buf, which must hold OUT_NUMSIZE bytes, and return
+// its length; these don't use sprintf
+int fmt_int(char* buf, long n);
+int fmt_unsigned(char* buf, unsigned long n);
+int fmt_float(char* buf, double d, int places);
+
+#endif
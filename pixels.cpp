@@ -0,0 +1,249 @@
+//
+// Packed pixel arrays: 3 bytes (r, g, b) per pixel, in the same layout as
+// a FastLED CRGB array. Colors are combined per channel with saturation, so
+// blends and fades of whole frames run in one pass without unpacking.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forth.h"
+
+#if defined(__ARM_FEATURE_SIMD32)
+#include <arm_acle.h>
+#endif
+
+
+//
+// The result of a pixel operation goes into the first operand's buffer
+// when that buffer is not shared, otherwise into a new buffer.
+//
+unsigned char* pxresult(Value* v)
+{
+  if (!v->arefs || *v->arefs == 1)
+    return v->px;
+  return pxalloc(v->len);
+}
+
+
+void pxpush(Value* v, unsigned char* rs)
+{
+  if (rs == v->px) {
+    forth_stack()->push(v);
+  } else {
+    forth_stack()->push(valloc(rs, v->len));
+    vfree(v);
+  }
+}
+
+
+// pixels per chunk when the second operand is a single color
+#define PX_SOLID_CHUNK 32
+
+
+// expand a packed int color into n pixels
+void pxsolid(unsigned char* px, int c, int n)
+{
+  for (int i = 0; i < n; i++) {
+    px[i*3] = (c >> 16) & 0xFF;
+    px[i*3+1] = (c >> 8) & 0xFF;
+    px[i*3+2] = c & 0xFF;
+  }
+}
+
+
+void pxaddsat(unsigned char* rs, const unsigned char* a, const unsigned char* b, int n, int r)
+{
+  int i = 0;
+#if defined(__ARM_FEATURE_SIMD32)
+  // four channels at a time with the Cortex-M saturating byte add
+  for (; i + 4 <= n; i += 4) {
+    uint32_t x, y;
+    memcpy(&x, a + i, 4);
+    memcpy(&y, b + i, 4);
+    x = __uqadd8(x, y);
+    memcpy(rs + i, &x, 4);
+  }
+#endif
+  for (; i < n; i++) {
+    int v = a[i] + b[i];
+    rs[i] = v > 255 ? 255 : v;
+  }
+}
+
+
+void pxsubsat(unsigned char* rs, const unsigned char* a, const unsigned char* b, int n, int r)
+{
+  int i = 0;
+#if defined(__ARM_FEATURE_SIMD32)
+  for (; i + 4 <= n; i += 4) {
+    uint32_t x, y;
+    memcpy(&x, a + i, 4);
+    memcpy(&y, b + i, 4);
+    x = __uqsub8(x, y);
+    memcpy(rs + i, &x, 4);
+  }
+#endif
+  for (; i < n; i++) {
+    int v = a[i] - b[i];
+    rs[i] = v < 0 ? 0 : v;
+  }
+}
+
+
+// r/256 of a and the rest of b
+void pxlerp(unsigned char* rs, const unsigned char* a, const unsigned char* b, int n, int r)
+{
+  for (int i = 0; i < n; i++)
+    rs[i] = (a[i] * r + b[i] * (256 - r)) >> 8;
+}
+
+
+// percent (0..100) to an 8.8 fixed point multiplier (0..256)
+int pxratio(int pct)
+{
+  if (pct < 0)
+    pct = 0;
+  if (pct > 100)
+    pct = 100;
+  return (pct * 256 + 50) / 100;
+}
+
+
+//
+// Forth words
+//
+
+// n -- px
+void op_px_new()
+{
+  int len = forth_stack()->popint();
+  if (len < 0)
+    len = 0;
+  forth_stack()->push(valloc(pxalloc(len), len));
+}
+
+
+// array -- px
+void op_px_from()
+{
+  Value* a = forth_stack()->pop();
+  if (a->vtype == PIXELS) {
+    forth_stack()->push(a);
+    return;
+  }
+  int len = a->vtype == ARRAY ? a->len : 0;
+  unsigned char* px = pxalloc(len);
+  for (int i = 0; i < len; i++) {
+    int c = a->ia[i];
+    px[i*3] = (c >> 16) & 0xFF;
+    px[i*3+1] = (c >> 8) & 0xFF;
+    px[i*3+2] = c & 0xFF;
+  }
+  forth_stack()->push(valloc(px, len));
+  vfree(a);
+}
+
+
+// px -- array
+void op_px_to()
+{
+  Value* a = forth_stack()->pop();
+  if (a->vtype == ARRAY) {
+    forth_stack()->push(a);
+    return;
+  }
+  int len = a->vtype == PIXELS ? a->len : 0;
+  int* ia = iaalloc(len);
+  for (int i = 0; i < len; i++)
+    ia[i] = pxcolor(a, i);
+  forth_stack()->push(ia, len);
+  vfree(a);
+}
+
+
+//
+// Apply a channel operation to two pixel arrays. The second operand can
+// also be a packed int color applied to every pixel; it is expanded into
+// a small buffer on the C stack and applied one chunk at a time. When
+// the second array is shorter, the pixels past its end are left as they
+// are in the first.
+//
+void pxbinary(void(*oper)(unsigned char*, const unsigned char*, const unsigned char*, int, int), Value* b, int r)
+{
+  Value* a = forth_stack()->pop();
+  if (a->vtype != PIXELS) {
+    vfree(b);
+    forth_stack()->push(a);
+    return;
+  }
+  unsigned char* rs = pxresult(a);
+  if (b->vtype == PIXELS) {
+    int n = b->len < a->len ? b->len : a->len;
+    (*oper)(rs, a->px, b->px, n*3, r);
+    if (rs != a->px)
+      memcpy(rs + n*3, a->px + n*3, (a->len - n)*3);
+  } else {
+    unsigned char solid[PX_SOLID_CHUNK*3];
+    pxsolid(solid, b->asint(), PX_SOLID_CHUNK);
+    for (int i = 0; i < a->len; i += PX_SOLID_CHUNK) {
+      int n = a->len - i < PX_SOLID_CHUNK ? a->len - i : PX_SOLID_CHUNK;
+      (*oper)(rs + i*3, a->px + i*3, solid, n*3, r);
+    }
+  }
+  vfree(b);
+  pxpush(a, rs);
+}
+
+
+// px px|c -- px
+void op_px_add()
+{
+  pxbinary(&pxaddsat, forth_stack()->pop(), 0);
+}
+
+
+// px px|c -- px
+void op_px_sub()
+{
+  pxbinary(&pxsubsat, forth_stack()->pop(), 0);
+}
+
+
+// px pct -- px
+void op_px_scale()
+{
+  int r = pxratio(forth_stack()->popint());
+  Value* a = forth_stack()->pop();
+  if (a->vtype != PIXELS) {
+    forth_stack()->push(a);
+    return;
+  }
+  unsigned char* rs = pxresult(a);
+  const unsigned char* pa = a->px;
+  int n = a->len*3;
+  for (int i = 0; i < n; i++)
+    rs[i] = (pa[i] * r) >> 8;
+  pxpush(a, rs);
+}
+
+
+// px1 px2|c pct -- px : pct% of px1 and the rest of px2, as led:blend
+void op_px_lerp()
+{
+  int r = pxratio(forth_stack()->popint());
+  pxbinary(&pxlerp, forth_stack()->pop(), r);
+}
+
+
+void pixels_init()
+{
+  forth_dict()->def("px:new", &op_px_new);
+  forth_dict()->def("px:from", &op_px_from);
+  forth_dict()->def("px:to", &op_px_to);
+  forth_dict()->def("px:add", &op_px_add);
+  forth_dict()->def("px:sub", &op_px_sub);
+  forth_dict()->def("px:scale", &op_px_scale);
+  forth_dict()->def("px:lerp", &op_px_lerp);
+}
@@ -0,0 +1,7 @@
+
+#ifndef forth_pixels_h
+#define forth_pixels_h
+
+void pixels_init();
+
+#endif
@@ -0,0 +1,260 @@
+//
+// Profiler: counts calls and cycles spent in each word while profiling is
+// on. Inclusive cycles cover everything a word does; exclusive cycles leave
+// out the words it calls. Built-in words are keyed by their function and
+// defined words by their sequence, so every copy of a word's Value counts
+// as the same word. When the region holding a sequence is freed, its entry
+// is given a key nothing else can have, so a later body at the same
+// address starts an entry of its own.
+//
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forth.h"
+#include "prof.h"
+#include "out.h"
+
+#if defined(__IMXRT1062__)
+// the Teensy 4 startup code enables the DWT cycle counter
+#define PROF_CYCLES() ((unsigned int)ARM_DWT_CYCCNT)
+#elif defined(ESP32)
+#include "esp_cpu.h"
+#define PROF_CYCLES() ((unsigned int)esp_cpu_get_cycle_count())
+#else
+#define PROF_CYCLES() ((unsigned int)micros())
+#endif
+
+
+struct PROFSTAT {
+  const void* key;      // NULL when the slot is unused
+  char* name;           // for work that is not a word; our own copy
+  int calls;
+  unsigned long long incl;
+  unsigned long long excl;
+};
+
+struct PROFFRAME {
+  PROFSTAT* stat;
+  unsigned int start;
+  unsigned long long inner;   // cycles spent in the words it called
+};
+
+PROFSTAT profstats[PROF_SLOTS];
+PROFFRAME profframes[PROF_MAXDEPTH];
+int profdepth = 0;
+bool prof_on = false;
+// calls that could not be timed: too deep, or out of slots
+int prof_missed = 0;
+
+
+PROFSTAT* prof_stat(const void* key)
+{
+  unsigned int h = ((unsigned long)key >> 2) * 2654435761u;
+  for (int i = 0; i < PROF_SLOTS; i++) {
+    PROFSTAT* st = &profstats[(h + i) % PROF_SLOTS];
+    if (st->key == key)
+      return st;
+    if (!st->key) {
+      st->key = key;
+      return st;
+    }
+  }
+  return NULL;
+}
+
+
+// Work that is not a word is matched by its name, not by the address of
+// the string: a loop task's name is freed by loop:forget, and a new name
+// may later land at the same address. The entry keeps its own copy of the
+// name and is keyed by that copy, which lives until prof:reset.
+PROFSTAT* prof_named(const char* name)
+{
+  unsigned int h = FDict::hash(name);
+  for (int i = 0; i < PROF_SLOTS; i++) {
+    PROFSTAT* st = &profstats[(h + i) % PROF_SLOTS];
+    if (st->name && !strcmp(st->name, name))
+      return st;
+    if (!st->key) {
+      st->name = strclone(name);
+      st->key = st->name;
+      return st;
+    }
+  }
+  return NULL;
+}
+
+
+// st is NULL when the call is too deep, or there was no free slot
+void prof_push(PROFSTAT* st)
+{
+  if (!st) {
+    // keep the depth right, so prof_exit still pairs up
+    if (profdepth < PROF_MAXDEPTH)
+      profframes[profdepth].stat = NULL;
+    prof_missed++;
+    profdepth++;
+    return;
+  }
+  PROFFRAME* f = &profframes[profdepth++];
+  f->stat = st;
+  f->inner = 0;
+  f->start = PROF_CYCLES();
+}
+
+
+void prof_pop()
+{
+  unsigned int now = PROF_CYCLES();
+  if (profdepth == 0)
+    return;
+  profdepth--;
+  if (profdepth >= PROF_MAXDEPTH)
+    return;
+  PROFFRAME* f = &profframes[profdepth];
+  if (!f->stat)
+    return;
+  unsigned int cycles = now - f->start;
+  f->stat->calls++;
+  f->stat->incl += cycles;
+  f->stat->excl += cycles - f->inner;
+  if (profdepth > 0 && profdepth <= PROF_MAXDEPTH)
+    profframes[profdepth - 1].inner += cycles;
+}
+
+
+void prof_enter(Value* fv)
+{
+  if (fv->func == &op_call && fv->seq)
+    prof_push(profdepth < PROF_MAXDEPTH ? prof_stat(fv->seq) : NULL);
+  else
+    prof_push(profdepth < PROF_MAXDEPTH ? prof_stat((const void*)fv->func) : NULL);
+}
+
+
+void prof_exit()
+{
+  prof_pop();
+}
+
+
+void prof_begin(const char* name)
+{
+  if (prof_on)
+    prof_push(profdepth < PROF_MAXDEPTH ? prof_named(name) : NULL);
+}
+
+
+void prof_end()
+{
+  if (prof_on)
+    prof_pop();
+}
+
+
+// a region is freed: retire the entries of the sequences it held, keeping
+// their slots, so later probes still get past them
+void prof_freed(const void* p, int size)
+{
+  const char* from = (const char*)p;
+  for (int i = 0; i < PROF_SLOTS; i++) {
+    PROFSTAT* st = &profstats[i];
+    const char* k = (const char*)st->key;
+    if (!st->name && k >= from && k < from + size)
+      st->key = st;
+  }
+}
+
+
+// the name of a word, from its key
+const char* prof_name(PROFSTAT* st)
+{
+  if (st->name)
+    return st->name;
+  for (Sym* sym = forth_dict()->head; sym; sym = sym->next) {
+    Value* v = sym->value;
+    if (v->vtype == SEQ && v->seq == st->key)
+      return sym->word;
+    if (v->vtype == FUNC && !v->seq && (const void*)v->func == st->key)
+      return sym->word;
+  }
+  FDict* d = forth_dict();
+  for (int w = 0; w < d->nbuiltins; w++)
+    if ((const void*)d->bwords[w].b->func == st->key)
+      return d->bwords[w].b->word;
+  return "?";
+}
+
+
+void op_prof_on()
+{
+  prof_on = true;
+  profdepth = 0;
+  forth_setprofiler(&prof_enter, &prof_exit);
+}
+
+
+void op_prof_off()
+{
+  forth_setprofiler(NULL, NULL);
+  prof_on = false;
+  profdepth = 0;
+}
+
+
+void op_prof_reset()
+{
+  for (int i = 0; i < PROF_SLOTS; i++)
+    if (profstats[i].name)
+      strdelete(profstats[i].name);
+  memset(profstats, 0, sizeof(profstats));
+  profdepth = 0;
+  prof_missed = 0;
+}
+
+
+// print one line per word, the most exclusive cycles first:
+//    name calls inclusive exclusive
+void op_prof_dump()
+{
+  bool done[PROF_SLOTS];
+  memset(done, 0, sizeof(done));
+  while (true) {
+    PROFSTAT* top = NULL;
+    int topi = 0;
+    for (int i = 0; i < PROF_SLOTS; i++) {
+      PROFSTAT* st = &profstats[i];
+      if (st->key && st->calls > 0 && !done[i] && (!top || st->excl > top->excl)) {
+        top = st;
+        topi = i;
+      }
+    }
+    if (!top)
+      break;
+    done[topi] = true;
+    out_str(prof_name(top));
+    out_char(' ');
+    out_int(top->calls);
+    out_char(' ');
+    out_unsigned((unsigned long)top->incl);
+    out_char(' ');
+    out_unsigned((unsigned long)top->excl);
+    out_line();
+  }
+  if (prof_missed > 0) {
+    out_str("untimed ");
+    out_int(prof_missed);
+    out_line();
+  }
+}
+
+
+void prof_init()
+{
+  forth_dict()->def("prof:on", &op_prof_on);
+  forth_dict()->def("prof:off", &op_prof_off);
+  forth_dict()->def("prof:reset", &op_prof_reset);
+  forth_dict()->def("prof:dump", &op_prof_dump);
+  forth_freefunction(&prof_freed);
+}
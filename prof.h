@@ -0,0 +1,16 @@
+#ifndef forth_prof_h
+#define forth_prof_h
+
+// distinct words (and loop tasks) the profiler keeps stats for
+#define PROF_SLOTS 128
+// deepest nesting of word calls that is timed
+#define PROF_MAXDEPTH 64
+
+void prof_init();
+
+// time a named piece of work that is not a word, such as a loop task;
+// does nothing unless profiling is on
+void prof_begin(const char* name);
+void prof_end();
+
+#endif
@@ -0,0 +1,281 @@
+//
+// Fixed-rate task scheduler: tasks defined with loop:every are kept in a
+// min-heap ordered by their next deadline, so each spin of the main loop
+// only looks at the earliest one. Deadlines are microsecond counts from
+// micros() and are compared by signed difference, which stays correct when
+// the counter wraps (about every 71 minutes). The next deadline is the
+// previous one plus the period, so a task's start times do not drift.
+//
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forth.h"
+#include "sched.h"
+#include "stats.h"
+
+
+struct SCHEDTASK {
+  char* name;       // NULL when the slot is unused
+  Value* code;
+  unsigned long period;
+  unsigned long deadline;
+  bool active;
+  // stats
+  int runs;
+  int overruns;     // periods skipped because the task started too late
+  unsigned long jitter;     // largest start delay past the deadline (us)
+  unsigned long jittersum;
+};
+
+SCHEDTASK tasks[SCHED_MAXTASKS];
+
+// heap of task slots, the earliest deadline at heap[0]
+int heap[SCHED_MAXTASKS];
+int nheap = 0;
+
+// the task being run from sched_loop, or -1
+int sched_running = -1;
+
+
+bool sched_before(int a, int b)
+{
+  return (long)(tasks[a].deadline - tasks[b].deadline) < 0;
+}
+
+
+void sched_swap(int i, int j)
+{
+  int t = heap[i];
+  heap[i] = heap[j];
+  heap[j] = t;
+}
+
+
+void sched_up(int i)
+{
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!sched_before(heap[i], heap[parent]))
+      break;
+    sched_swap(i, parent);
+    i = parent;
+  }
+}
+
+
+void sched_down(int i)
+{
+  while (true) {
+    int least = i;
+    int l = 2*i + 1;
+    int r = l + 1;
+    if (l < nheap && sched_before(heap[l], heap[least]))
+      least = l;
+    if (r < nheap && sched_before(heap[r], heap[least]))
+      least = r;
+    if (least == i)
+      break;
+    sched_swap(i, least);
+    i = least;
+  }
+}
+
+
+void sched_push(int t)
+{
+  heap[nheap] = t;
+  sched_up(nheap++);
+}
+
+
+void sched_remove(int t)
+{
+  for (int i = 0; i < nheap; i++) {
+    if (heap[i] == t) {
+      heap[i] = heap[--nheap];
+      if (i < nheap) {
+        sched_up(i);
+        sched_down(i);
+      }
+      return;
+    }
+  }
+}
+
+
+int sched_find(const char* name)
+{
+  for (int t = 0; t < SCHED_MAXTASKS; t++)
+    if (tasks[t].name && tasks[t].active && strcmp(tasks[t].name, name) == 0)
+      return t;
+  return -1;
+}
+
+
+void sched_free(int t)
+{
+  tasks[t].name = strdelete(tasks[t].name);
+  vfree(tasks[t].code);
+  tasks[t].code = NULL;
+}
+
+
+void sched_cancel(int t)
+{
+  tasks[t].active = false;
+  // a task that is running is freed when it returns to sched_loop
+  if (t != sched_running) {
+    sched_remove(t);
+    sched_free(t);
+  }
+}
+
+
+void sched_loop()
+{
+  if (nheap == 0)
+    return;
+  int t = heap[0];
+  unsigned long now = micros();
+  long late = (long)(now - tasks[t].deadline);
+  if (late < 0)
+    return;
+
+  // take the task out while it runs, in case it changes the schedule
+  heap[0] = heap[--nheap];
+  sched_down(0);
+
+  SCHEDTASK* task = &tasks[t];
+  task->runs++;
+  task->jittersum += late;
+  if ((unsigned long)late > task->jitter)
+    task->jitter = late;
+  sched_running = t;
+  forth_run(task->code);
+  sched_running = -1;
+  stat_add(STAT_TASK, micros() - now);
+
+  if (!task->active) {
+    sched_free(t);
+    return;
+  }
+  task->deadline += task->period;
+  // a task that is more than a period behind skips the deadlines it
+  // missed, rather than running back to back to catch up
+  now = micros();
+  while ((long)(now - task->deadline) >= 0) {
+    task->deadline += task->period;
+    task->overruns++;
+  }
+  sched_push(t);
+}
+
+
+// code period_us 'name --
+void op_loop_every()
+{
+  char* name = forth_stack()->popstring();
+  int period = forth_stack()->popint();
+  Value* code = forth_stack()->pop();
+  int t = sched_find(name);
+  if (t >= 0)
+    sched_cancel(t);
+  for (t = 0; t < SCHED_MAXTASKS && tasks[t].name; t++)
+    ;
+  if (t == SCHED_MAXTASKS || period <= 0) {
+    strdelete(name);
+    vfree(code);
+    return;
+  }
+  // the sequence literal only lives as long as the line that defined it
+  if (code->vtype == SEQ) {
+    if (!code->seq->region)
+      code->seq = region_clone(code->seq);
+    if (!code->seq->code)
+      code->seq->compile();
+  }
+  SCHEDTASK* task = &tasks[t];
+  task->name = name;
+  task->code = code;
+  task->period = period;
+  task->deadline = micros() + period;
+  task->active = true;
+  task->runs = 0;
+  task->overruns = 0;
+  task->jitter = 0;
+  task->jittersum = 0;
+  sched_push(t);
+}
+
+
+// 'name --
+void op_loop_cancel()
+{
+  Value* name = forth_stack()->popstr();
+  int t = sched_find(name->str);
+  if (t >= 0)
+    sched_cancel(t);
+  vfree(name);
+}
+
+
+// push one of a task's stats, or -1 for an unknown task
+void sched_stat(int which)
+{
+  Value* name = forth_stack()->popstr();
+  int t = sched_find(name->str);
+  vfree(name);
+  if (t < 0) {
+    forth_stack()->push(-1);
+    return;
+  }
+  SCHEDTASK* task = &tasks[t];
+  switch (which) {
+    case 0:
+      forth_stack()->push(task->runs);
+      break;
+    case 1:
+      forth_stack()->push(task->overruns);
+      break;
+    case 2:
+      forth_stack()->push((int)task->jitter);
+      break;
+    case 3:
+      forth_stack()->push(task->runs > 0 ? (int)(task->jittersum / task->runs) : 0);
+      break;
+  }
+}
+
+
+void op_loop_runs()
+{
+  sched_stat(0);
+}
+
+void op_loop_overruns()
+{
+  sched_stat(1);
+}
+
+void op_loop_jitter()
+{
+  sched_stat(2);
+}
+
+void op_loop_jitter_avg()
+{
+  sched_stat(3);
+}
+
+
+void sched_init()
+{
+  forth_dict()->def("loop:every", &op_loop_every);
+  forth_dict()->def("loop:cancel", &op_loop_cancel);
+  forth_dict()->def("loop:runs", &op_loop_runs);
+  forth_dict()->def("loop:overruns", &op_loop_overruns);
+  forth_dict()->def("loop:jitter", &op_loop_jitter);
+  forth_dict()->def("loop:jitter:avg", &op_loop_jitter_avg);
+}
@@ -0,0 +1,10 @@
+#ifndef forth_sched_h
+#define forth_sched_h
+
+// most tasks that can be scheduled with loop:every at one time
+#define SCHED_MAXTASKS 16
+
+void sched_init();
+void sched_loop();
+
+#endif
@@ -0,0 +1,116 @@
+//
+// Timing histograms: fixed power-of-two buckets in microseconds, so an
+// update is a count of leading zeros and two adds. Each stat: word pushes a
+// one-line summary that can be printed to serial or into a UDP reply:
+//
+//   count min avg max | b0 b1 b2 ...
+//
+// with times in microseconds, and the bucket counts up to the last one
+// that isn't empty.
+//
+
+#include <Arduino.h>
+#include <string.h>
+
+#include "forth.h"
+#include "stats.h"
+#include "out.h"
+
+
+struct STATHISTOGRAM {
+  unsigned long count;
+  unsigned long min;
+  unsigned long max;
+  unsigned long long sum;
+  unsigned long buckets[STAT_BUCKETS];
+};
+
+STATHISTOGRAM stathists[STAT_NHIST];
+
+
+void stat_add(int hist, unsigned long us)
+{
+  STATHISTOGRAM* h = &stathists[hist];
+  int b = us == 0 ? 0 : 32 - __builtin_clz((unsigned int)us);
+  if (b >= STAT_BUCKETS)
+    b = STAT_BUCKETS - 1;
+  h->buckets[b]++;
+  if (h->count == 0 || us < h->min)
+    h->min = us;
+  if (us > h->max)
+    h->max = us;
+  h->count++;
+  h->sum += us;
+}
+
+
+void stat_push(int hist)
+{
+  STATHISTOGRAM* h = &stathists[hist];
+  unsigned long head[4] = { h->count, h->min,
+    h->count ? (unsigned long)(h->sum / h->count) : 0UL, h->max };
+  char s[(4 + STAT_BUCKETS) * OUT_NUMSIZE];
+  int n = 0;
+  for (int i = 0; i < 4; i++) {
+    n += fmt_unsigned(s + n, head[i]);
+    s[n++] = ' ';
+  }
+  s[n++] = '|';
+  int last = STAT_BUCKETS - 1;
+  while (last > 0 && h->buckets[last] == 0)
+    last--;
+  for (int i = 0; i <= last; i++) {
+    s[n++] = ' ';
+    n += fmt_unsigned(s + n, h->buckets[i]);
+  }
+  s[n] = 0;
+  forth_stack()->push(s);
+}
+
+
+void op_stat_latency()
+{
+  stat_push(STAT_LATENCY);
+}
+
+void op_stat_parse()
+{
+  stat_push(STAT_PARSE);
+}
+
+void op_stat_exec()
+{
+  stat_push(STAT_EXEC);
+}
+
+void op_stat_task()
+{
+  stat_push(STAT_TASK);
+}
+
+void op_stat_show()
+{
+  stat_push(STAT_SHOW);
+}
+
+void op_stat_frame()
+{
+  stat_push(STAT_FRAME);
+}
+
+void op_stat_reset()
+{
+  memset(stathists, 0, sizeof(stathists));
+}
+
+
+void stats_init()
+{
+  forth_dict()->def("stat:latency", &op_stat_latency);
+  forth_dict()->def("stat:parse", &op_stat_parse);
+  forth_dict()->def("stat:exec", &op_stat_exec);
+  forth_dict()->def("stat:task", &op_stat_task);
+  forth_dict()->def("stat:show", &op_stat_show);
+  forth_dict()->def("stat:frame", &op_stat_frame);
+  forth_dict()->def("stat:reset", &op_stat_reset);
+}
@@ -0,0 +1,21 @@
+#ifndef forth_stats_h
+#define forth_stats_h
+
+// Timing histograms. Bucket 0 counts times under 1us, and bucket i counts
+// times from 2^(i-1) up to 2^i us; the last bucket takes everything longer.
+#define STAT_BUCKETS 20
+
+enum STATHIST {
+  STAT_LATENCY,   // first byte of a command line received, to its run finished
+  STAT_PARSE,     // parsing one line
+  STAT_EXEC,      // running one line
+  STAT_TASK,      // one run of a loop task
+  STAT_SHOW,      // one led:show of a frame from the frame pipeline
+  STAT_FRAME,     // time between frames shown
+  STAT_NHIST
+};
+
+void stats_init();
+void stat_add(int hist, unsigned long us);
+
+#endif
@@ -0,0 +1,181 @@
+//
+// Cooperative tasks: each task runs a sequence on its own value stack and
+// stash, one time slice per pass of the main loop. A slice ends when the
+// task calls yield or task:sleep, or when its sequence is done.
+//
+// Each task has a return stack of its own, and a slice resumes it with
+// forth_resume, so a task can yield from inside word calls, if/ife blocks
+// and loop/repeat and pick up where it stopped. Any other word runs to
+// completion; a yield inside it (e.g. in a map block) ends the slice when
+// that word returns.
+//
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forth.h"
+#include "task.h"
+
+
+struct TASK {
+  char* name;       // NULL when the slot is unused
+  Value* body;
+  ValueStack* stack;
+  ValueStack* stash;
+  RFrame frames[TASK_MAXFRAMES];
+  RStack rs;
+  unsigned long wake;
+  bool sleeping;
+  bool killed;
+};
+
+TASK tasklist[TASK_MAX];
+
+// the task in its time slice, or NULL
+TASK* task_current = NULL;
+
+
+void task_free(TASK* task)
+{
+  task->name = strdelete(task->name);
+  rstack_clear(&task->rs);
+  vfree(task->body);
+  delete task->stack;
+  delete task->stash;
+  task->body = NULL;
+}
+
+
+TASK* task_find(const char* name)
+{
+  for (int t = 0; t < TASK_MAX; t++)
+    if (tasklist[t].name && !tasklist[t].killed && strcmp(tasklist[t].name, name) == 0)
+      return &tasklist[t];
+  return NULL;
+}
+
+
+void task_kill(TASK* task)
+{
+  if (task == task_current) {
+    // a task killing itself ends with this slice
+    task->killed = true;
+    forth_yield();
+  } else {
+    task_free(task);
+  }
+}
+
+
+// run a task until it yields, sleeps, or finishes; true if it finished
+bool task_slice(TASK* task)
+{
+  forth_swapstacks(&task->stack, &task->stash);
+  task_current = task;
+  RStack* prev = forth_setrstack(&task->rs);
+  bool done = forth_resume();
+  forth_setrstack(prev);
+  task_current = NULL;
+  forth_swapstacks(&task->stack, &task->stash);
+  return done || task->killed;
+}
+
+
+void task_loop()
+{
+  unsigned long now = micros();
+  for (int t = 0; t < TASK_MAX; t++) {
+    TASK* task = &tasklist[t];
+    if (!task->name)
+      continue;
+    if (task->sleeping) {
+      if ((long)(now - task->wake) < 0)
+        continue;
+      task->sleeping = false;
+    }
+    if (task_slice(task))
+      task_free(task);
+  }
+}
+
+
+// seq 'name --
+void op_task_spawn()
+{
+  char* name = forth_stack()->popstring();
+  Value* body = forth_stack()->pop();
+  TASK* task = task_find(name);
+  if (task)
+    task_kill(task);
+  task = NULL;
+  for (int t = 0; t < TASK_MAX && !task; t++)
+    if (!tasklist[t].name)
+      task = &tasklist[t];
+  if (!task || body->vtype != SEQ) {
+    strdelete(name);
+    vfree(body);
+    return;
+  }
+  // the sequence literal only lives as long as the line that spawned it
+  if (!body->seq->region)
+    body->seq = region_clone(body->seq);
+  task->name = name;
+  task->body = body;
+  task->stack = new ValueStack();
+  task->stash = new ValueStack();
+  rstack_init(&task->rs, task->frames, TASK_MAXFRAMES);
+  task->sleeping = false;
+  task->killed = false;
+  rstack_enter(&task->rs, body->seq);
+}
+
+
+// 'name --
+void op_task_kill()
+{
+  Value* name = forth_stack()->popstr();
+  TASK* task = task_find(name->str);
+  if (task)
+    task_kill(task);
+  vfree(name);
+}
+
+
+void op_yield()
+{
+  if (task_current)
+    forth_yield();
+}
+
+
+// ms --
+void op_task_sleep()
+{
+  int ms = forth_stack()->popint();
+  if (task_current) {
+    task_current->wake = micros() + (unsigned long)ms * 1000;
+    task_current->sleeping = true;
+    forth_yield();
+  }
+}
+
+
+void op_task_count()
+{
+  int n = 0;
+  for (int t = 0; t < TASK_MAX; t++)
+    if (tasklist[t].name)
+      n++;
+  forth_stack()->push(n);
+}
+
+
+void task_init()
+{
+  forth_dict()->def("task:spawn", &op_task_spawn);
+  forth_dict()->def("task:kill", &op_task_kill);
+  forth_dict()->def("task:sleep", &op_task_sleep);
+  forth_dict()->def("task:count", &op_task_count);
+  forth_dict()->def("yield", &op_yield);
+}
@@ -0,0 +1,13 @@
+#ifndef forth_task_h
+#define forth_task_h
+
+// most tasks that can be spawned at one time
+#define TASK_MAX 8
+// frames in a task's return stack: the deepest nesting of blocks and
+// word calls (not counting tail calls) a task can run
+#define TASK_MAXFRAMES 32
+
+void task_init();
+void task_loop();
+
+#endif